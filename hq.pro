@@ -9,14 +9,17 @@ QT       -= core gui
 TARGET = hq
 TEMPLATE = lib
 
-DEFINES += HQ_LIBRARY
+DEFINES += HQ_LIBRARY _GNU_SOURCE
 
-QMAKE_CFLAGS += -std=c99
+# decode counters, logged with hq.stats_log and read through hq_get_stats
+#DEFINES += HQ_STATS
+
+QMAKE_CFLAGS += -std=c99 -ftree-vectorize
 
 LIBS += -L$$OUT_PWD/QSoundCore/Core/ \
         -L$$OUT_PWD/psflib/
 
-LIBS += -lpsflib -lQSoundCore -lz
+LIBS += -lpsflib -lQSoundCore -lz -lm
 
 DEPENDPATH += $$PWD/QSoundCore/Core \
               $$PWD/psflib
@@ -30,7 +33,8 @@ INCLUDEPATH += QSoundCore/Core \
 SOURCES += \
     hqplug.c
 
-HEADERS +=
+HEADERS += \
+    hqstats.h
 
 unix:!symbian {
     maemo5 {
@@ -0,0 +1,568 @@
+/*
+    hqbench - headless throughput benchmark for the QSF decoder
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hqhost.h"
+
+static void
+usage (void) {
+    fprintf (stderr,
+        "usage: hqbench [options] file...\n"
+        "  -t seconds     render this much of every track (default 60)\n"
+        "  -r bytes       size of each read request (default 4096)\n"
+        "  -k count       seek-heavy run: seek this many times per track\n"
+        "  -b frames      emulator render block, same as -o hq.render_block=frames\n"
+        "  -o key=value   set a plugin option, e.g. -o hq.render_ahead=1, or\n"
+        "                 -o hq.rom_arena=0 to keep ROM images on the heap\n"
+        "  -S             print the plugin's decode counters for every track\n"
+        "                 (needs a build with HQ_STATS)\n"
+        "  -I             time adding the files to a playlist instead of decoding\n"
+        "  -P             play the files through as a playlist and time the track\n"
+        "                 changes, e.g. with -o hq.preload=1\n"
+        "  -v             with -I, list what was added\n"
+        "  -w seconds     with -I, let background work such as length detection or\n"
+        "                 -o hq.replaygain_scan=1 run this long before listing\n"
+        "verification modes, -t 0 covers whole tracks including the fade:\n"
+        "  -H             print a hash of every second of output\n"
+        "  -G file        compare against hashes saved from -H, exit 1 on mismatch\n"
+        "  -E count       check that seeking to a spot and rendering matches\n"
+        "                 rendering from the start, at this many spots per track\n");
+    exit (1);
+}
+
+typedef struct {
+    double load;
+    double render;
+    double seek;
+    long frames;
+    int seeks;
+} bench_result_t;
+
+static int show_stats;
+
+static void
+print_stats (const char *fname, DB_fileinfo_t *fi) {
+    hq_stats_t st;
+    if (hq_get_stats (fi, &st) < 0) {
+        return;
+    }
+    // the read time under which 99% of the reads finished, to the histogram's resolution
+    uint64_t seen = 0;
+    int p99 = 0;
+    while (p99 < HQ_STATS_READ_BUCKETS - 1 && ( seen += st.read_hist[p99] ) * 100 < st.reads * 99) {
+        p99++;
+    }
+    printf ("%-32s load %8.3f ms  reads %6llu  avg %8.1f us  p99 < %6d us  max %8.1f us  silent %9llu  rendered %9llu  skipped %9llu"
+            "  seeks %4llu (%llu from start)  %7.2fx realtime\n",
+            fname, st.load_ns / 1e6, (unsigned long long)st.reads, st.reads ? st.read_ns / 1e3 / st.reads : 0.,
+            2 << p99, st.read_max_ns / 1e3, (unsigned long long)st.frames_silent, (unsigned long long)st.frames_rendered,
+            (unsigned long long)st.frames_skipped, (unsigned long long)st.seeks,
+            (unsigned long long)st.seek_resets, st.realtime);
+}
+
+static int
+bench_track (const char *fname, int seconds, int read_size, int seeks, bench_result_t *res) {
+    DB_playItem_t *it = hqhost_item_new (fname);
+    DB_fileinfo_t *fi = hq_plugin.open (0);
+
+    double t = hqhost_time ();
+    if (hq_plugin.init (fi, it) < 0) {
+        fprintf (stderr, "%s: failed to open\n", fname);
+        hq_plugin.free (fi);
+        hqhost_item_free (it);
+        return -1;
+    }
+    res->load += hqhost_time () - t;
+
+    int samplerate = fi->fmt.samplerate;
+    int frame_size = fi->fmt.channels * fi->fmt.bps / 8;
+    long frames_wanted = (long)seconds * samplerate;
+    long frames = 0;
+    char *buffer = malloc (read_size);
+
+    // seeks land at pseudo-random spots, each followed by a second of playback
+    unsigned seed = 12345;
+    long span = seeks ? samplerate : frames_wanted;
+    int seek;
+    for (seek = 0; seek <= seeks; seek++) {
+        if (seek) {
+            seed = seed * 1103515245 + 12345;
+            int target = (seed >> 8) % frames_wanted;
+            t = hqhost_time ();
+            if (hq_plugin.seek_sample (fi, target) < 0) {
+                break;
+            }
+            res->seek += hqhost_time () - t;
+            res->seeks++;
+        }
+
+        long done = 0;
+        t = hqhost_time ();
+        while (done < span) {
+            int size = read_size;
+            if ((span - done) * frame_size < size) {
+                size = (span - done) * frame_size;
+            }
+            int rd = hq_plugin.read (fi, buffer, size);
+            if (rd <= 0) {
+                break;
+            }
+            done += rd / frame_size;
+        }
+        res->render += hqhost_time () - t;
+        frames += done;
+    }
+    res->frames += frames;
+
+    if (show_stats) {
+        const char *name = strrchr (fname, '/');
+        print_stats (name ? name + 1 : fname, fi);
+    }
+
+    free (buffer);
+    hq_plugin.free (fi);
+    hqhost_item_free (it);
+    return samplerate;
+}
+
+#define HASH_INIT 0xcbf29ce484222325ULL
+
+static uint64_t
+hash_bytes (uint64_t h, const void *data, size_t size) {
+    const unsigned char *p = data;
+    while (size--) {
+        h = ( h ^ *p++ ) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+typedef struct {
+    DB_playItem_t *it;
+    DB_fileinfo_t *fi;
+    int frame_size;
+    char *buffer;
+    int read_size;
+} verify_stream_t;
+
+static int
+verify_open (verify_stream_t *vs, const char *fname, int read_size) {
+    vs->it = hqhost_item_new (fname);
+    vs->fi = hq_plugin.open (0);
+    if (hq_plugin.init (vs->fi, vs->it) < 0) {
+        fprintf (stderr, "%s: failed to open\n", fname);
+        hq_plugin.free (vs->fi);
+        hqhost_item_free (vs->it);
+        return -1;
+    }
+    vs->frame_size = vs->fi->fmt.channels * vs->fi->fmt.bps / 8;
+    vs->read_size = read_size / vs->frame_size * vs->frame_size;
+    vs->buffer = malloc (vs->read_size);
+    return 0;
+}
+
+static void
+verify_close (verify_stream_t *vs) {
+    free (vs->buffer);
+    hq_plugin.free (vs->fi);
+    hqhost_item_free (vs->it);
+}
+
+// hash the next frames of output, or discard them with hash NULL; returns frames produced
+static long
+verify_render (verify_stream_t *vs, long frames, uint64_t *hash) {
+    long done = 0;
+    while (done < frames) {
+        int size = vs->read_size;
+        if ((frames - done) * vs->frame_size < size) {
+            size = (frames - done) * vs->frame_size;
+        }
+        int rd = hq_plugin.read (vs->fi, vs->buffer, size);
+        if (rd <= 0) {
+            break;
+        }
+        if (hash) {
+            *hash = hash_bytes (*hash, vs->buffer, rd);
+        }
+        done += rd / vs->frame_size;
+    }
+    return done;
+}
+
+typedef struct {
+    char *name;
+    int block;
+    uint64_t hash;
+} golden_t;
+
+static golden_t *goldens;
+static int golden_count;
+
+static void
+golden_load (const char *fname) {
+    FILE *f = fopen (fname, "r");
+    if (!f) {
+        perror (fname);
+        exit (1);
+    }
+    char name[1024];
+    int block;
+    unsigned long long hash;
+    while (fscanf (f, "%1023s %d %llx", name, &block, &hash) == 3) {
+        goldens = realloc (goldens, (golden_count + 1) * sizeof (golden_t));
+        goldens[golden_count].name = strdup (name);
+        goldens[golden_count].block = block;
+        goldens[golden_count].hash = hash;
+        golden_count++;
+    }
+    fclose (f);
+}
+
+static const golden_t *
+golden_find (const char *name, int block) {
+    int i;
+    for (i = 0; i < golden_count; i++) {
+        if (goldens[i].block == block && !strcmp (goldens[i].name, name)) {
+            return &goldens[i];
+        }
+    }
+    return NULL;
+}
+
+// hash each second of output, printing it or checking it against the goldens
+static int
+verify_hashes (const char *fname, int seconds, int read_size) {
+    verify_stream_t vs;
+    if (verify_open (&vs, fname, read_size) < 0) {
+        return -1;
+    }
+
+    int samplerate = vs.fi->fmt.samplerate;
+    int failed = 0;
+    int block;
+    for (block = 0; !seconds || block < seconds; block++) {
+        uint64_t hash = HASH_INIT;
+        if (!verify_render (&vs, samplerate, &hash)) {
+            break;
+        }
+        if (!golden_count) {
+            printf ("%s %d %016llx\n", fname, block, (unsigned long long)hash);
+            continue;
+        }
+        const golden_t *g = golden_find (fname, block);
+        if (!g || g->hash != hash) {
+            printf ("%s: block %d %s\n", fname, block, g ? "differs" : "has no golden hash");
+            failed = 1;
+        }
+    }
+    if (golden_count && golden_find (fname, block)) {
+        printf ("%s: ends early at block %d\n", fname, block);
+        failed = 1;
+    }
+
+    verify_close (&vs);
+    return failed ? -1 : 0;
+}
+
+// compare rendering after a seek to discarding the same span from the start,
+// for seeks from a fresh decoder as well as backwards from further in
+static int
+verify_seeks (const char *fname, int seconds, int read_size, int count) {
+    verify_stream_t ref, fwd, back;
+    if (verify_open (&ref, fname, read_size) < 0) {
+        return -1;
+    }
+    int samplerate = ref.fi->fmt.samplerate;
+    long span = (long)( seconds ? seconds : 60 ) * samplerate;
+    verify_close (&ref);
+
+    int failed = 0, skipped = 0;
+    unsigned seed = 54321;
+    int i;
+    for (i = 0; i < count; i++) {
+        seed = seed * 1103515245 + 12345;
+        int target = (seed >> 8) % span;
+        uint64_t h_ref = HASH_INIT, h_fwd = HASH_INIT, h_back = HASH_INIT;
+
+        if (verify_open (&ref, fname, read_size) < 0) {
+            return -1;
+        }
+        long got = verify_render (&ref, target, NULL);
+        if (got == target) {
+            verify_render (&ref, samplerate, &h_ref);
+        }
+        verify_close (&ref);
+        // past the end there is nothing to compare
+        if (got != target) {
+            skipped++;
+            continue;
+        }
+
+        if (verify_open (&fwd, fname, read_size) < 0) {
+            return -1;
+        }
+        int fwd_ok = hq_plugin.seek_sample (fwd.fi, target) == 0;
+        if (fwd_ok) {
+            verify_render (&fwd, samplerate, &h_fwd);
+        }
+        verify_close (&fwd);
+
+        if (verify_open (&back, fname, read_size) < 0) {
+            return -1;
+        }
+        verify_render (&back, target + samplerate * 2, NULL);
+        int back_ok = hq_plugin.seek_sample (back.fi, target) == 0;
+        if (back_ok) {
+            verify_render (&back, samplerate, &h_back);
+        }
+        verify_close (&back);
+
+        if (!fwd_ok || !back_ok) {
+            printf ("%s: seek to %d failed (%s)\n", fname, target, !fwd_ok ? "forward" : "backward");
+            failed = 1;
+        }
+        else if (h_fwd != h_ref || h_back != h_ref) {
+            printf ("%s: seek to %d differs (%s)\n", fname, target,
+                    h_fwd != h_ref ? "forward" : "backward");
+            failed = 1;
+        }
+    }
+    if (skipped) {
+        printf ("%s: skipped %d of %d seeks past the end\n", fname, skipped, count);
+    }
+    return failed ? -1 : 0;
+}
+
+// time hq_insert over all files, the way the host adds a folder
+static void
+bench_insert (char **files, int count, int verbose, int wait) {
+    double t = hqhost_time ();
+    int i;
+    for (i = 0; i < count; i++) {
+        hq_plugin.insert (NULL, NULL, files[i]);
+    }
+    t = hqhost_time () - t;
+
+    if (wait > 0) {
+        sleep (wait);
+    }
+
+    int added = hqhost_playlist_count ();
+    if (verbose) {
+        for (i = 0; i < added; i++) {
+            DB_playItem_t *it = hqhost_playlist_get (i);
+            const char *title = hqhost_item_meta (it, "title");
+            printf ("%8.2f  %-32s  track %+6.2f dB peak %.3f  album %+6.2f dB peak %.3f  %s\n",
+                    hqhost_item_duration (it), title ? title : "",
+                    hqhost_item_replaygain (it, DDB_REPLAYGAIN_TRACKGAIN), hqhost_item_replaygain (it, DDB_REPLAYGAIN_TRACKPEAK),
+                    hqhost_item_replaygain (it, DDB_REPLAYGAIN_ALBUMGAIN), hqhost_item_replaygain (it, DDB_REPLAYGAIN_ALBUMPEAK),
+                    hqhost_item_meta (it, ":URI"));
+        }
+    }
+    printf ("added %d of %d files in %.3f s, %.0f files/s\n", added, count, t, count / t);
+}
+
+// play the files back to back as one playlist, timing each track change from the last read
+// of one track to the first read of the next, which is where a gap would be heard
+static void
+bench_playlist (char **files, int count, int read_size) {
+    int i;
+    for (i = 0; i < count; i++) {
+        hq_plugin.insert (NULL, NULL, files[i]);
+    }
+
+    char *buffer = malloc (read_size);
+    DB_fileinfo_t *fi = NULL;
+    double t = hqhost_time (), worst = 0, sum = 0;
+    int changes = 0;
+    int n = hqhost_playlist_count ();
+    for (i = 0; i < n; i++) {
+        DB_playItem_t *it = hqhost_playlist_get (i);
+        if (fi) {
+            hq_plugin.free (fi);
+        }
+        fi = hq_plugin.open (0);
+        if (hq_plugin.init (fi, it) < 0) {
+            fprintf (stderr, "%s: failed to open\n", hqhost_item_meta (it, ":URI"));
+            continue;
+        }
+        int rd = hq_plugin.read (fi, buffer, read_size);
+        double gap = hqhost_time () - t;
+        if (i) {
+            changes++;
+            sum += gap;
+            if (gap > worst) {
+                worst = gap;
+            }
+        }
+        printf ("%8.3f ms  %s\n", gap * 1000, hqhost_item_meta (it, ":URI"));
+        while (rd > 0) {
+            rd = hq_plugin.read (fi, buffer, read_size);
+        }
+        t = hqhost_time ();
+    }
+    if (fi) {
+        hq_plugin.free (fi);
+    }
+    free (buffer);
+    if (changes) {
+        printf ("%d track changes, %.3f ms average, %.3f ms worst\n", changes, sum * 1000 / changes, worst * 1000);
+    }
+}
+
+static void
+print_result (const char *name, const bench_result_t *res, int samplerate) {
+    double audio = (double)res->frames / samplerate;
+    printf ("%-32s load %8.3f ms  render %8.3f s  %10.0f samples/s  %7.2fx realtime",
+            name, res->load * 1000, res->render, res->frames / res->render, audio / res->render);
+    if (res->seeks) {
+        printf ("  seek %8.3f ms avg", res->seek * 1000 / res->seeks);
+    }
+    printf ("\n");
+}
+
+int
+main (int argc, char **argv) {
+    int seconds = 60;
+    int read_size = 4096;
+    int seeks = 0;
+    int hashes = 0;
+    int seek_checks = 0;
+    int insert = 0;
+    int playlist = 0;
+    int verbose = 0;
+    int wait = 0;
+    int opt;
+
+    while ((opt = getopt (argc, argv, "t:r:k:b:o:HG:E:IPSvw:")) != -1) {
+        switch (opt) {
+        case 't':
+            seconds = atoi (optarg);
+            break;
+        case 'r':
+            read_size = atoi (optarg) & ~3;
+            break;
+        case 'k':
+            seeks = atoi (optarg);
+            break;
+        case 'H':
+            hashes = 1;
+            break;
+        case 'G':
+            golden_load (optarg);
+            hashes = 1;
+            break;
+        case 'E':
+            seek_checks = atoi (optarg);
+            break;
+        case 'I':
+            insert = 1;
+            break;
+        case 'P':
+            playlist = 1;
+            break;
+        case 'S':
+            show_stats = 1;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        case 'w':
+            wait = atoi (optarg);
+            break;
+        case 'b':
+            hqhost_conf_set ("hq.render_block", optarg);
+            break;
+        case 'o': {
+            char *eq = strchr (optarg, '=');
+            if (!eq) {
+                usage ();
+            }
+            *eq = 0;
+            hqhost_conf_set (optarg, eq + 1);
+            break;
+        }
+        default:
+            usage ();
+        }
+    }
+    if (optind >= argc || seconds < 0 || read_size <= 0) {
+        usage ();
+    }
+
+    hqhost_init ();
+
+    if (insert) {
+        bench_insert (argv + optind, argc - optind, verbose, wait);
+        hqhost_shutdown ();
+        return 0;
+    }
+
+    if (playlist) {
+        bench_playlist (argv + optind, argc - optind, read_size);
+        hqhost_shutdown ();
+        return 0;
+    }
+
+    if (hashes || seek_checks) {
+        int failed = 0;
+        int i;
+        for (i = optind; i < argc; i++) {
+            if (hashes && verify_hashes (argv[i], seconds, read_size) < 0) {
+                failed = 1;
+            }
+            if (seek_checks && verify_seeks (argv[i], seconds, read_size, seek_checks) < 0) {
+                failed = 1;
+            }
+        }
+        hqhost_shutdown ();
+        return failed;
+    }
+
+    if (!seconds) {
+        usage ();
+    }
+
+    bench_result_t total;
+    memset (&total, 0, sizeof (total));
+    int samplerate = 0;
+    int i;
+    for (i = optind; i < argc; i++) {
+        bench_result_t res;
+        memset (&res, 0, sizeof (res));
+        int rate = bench_track (argv[i], seconds, read_size, seeks, &res);
+        if (rate <= 0) {
+            continue;
+        }
+        const char *name = strrchr (argv[i], '/');
+        print_result (name ? name + 1 : argv[i], &res, rate);
+        samplerate = rate;
+        total.load += res.load;
+        total.render += res.render;
+        total.seek += res.seek;
+        total.frames += res.frames;
+        total.seeks += res.seeks;
+    }
+    if (samplerate) {
+        print_result ("total", &total, samplerate);
+    }
+
+    size_t mapped, heap;
+    int page_size;
+    long faults;
+    hq_rom_arena_stats (&mapped, &heap, &page_size, &faults);
+    printf ("rom images: %.1f MB mapped with %d KB pages, %.1f MB on the heap, %ld page faults while loading\n",
+            mapped / 1048576.0, page_size / 1024, heap / 1048576.0, faults);
+
+    hqhost_shutdown ();
+    return 0;
+}
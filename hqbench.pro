@@ -0,0 +1,40 @@
+#-------------------------------------------------
+#
+# Headless benchmark for the decoder, built against
+# a stub host instead of DeaDBeeF
+#
+#-------------------------------------------------
+
+QT       -= core gui
+
+TARGET = hqbench
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle qt
+
+DEFINES += _GNU_SOURCE HQ_STATS
+
+QMAKE_CFLAGS += -std=c99 -ftree-vectorize
+
+LIBS += -L$$OUT_PWD/QSoundCore/Core/ \
+        -L$$OUT_PWD/psflib/
+
+LIBS += -lpsflib -lQSoundCore -lz -lpthread -lm
+
+DEPENDPATH += $$PWD/QSoundCore/Core \
+              $$PWD/psflib
+
+PRE_TARGETDEPS += $$OUT_PWD/QSoundCore/Core/libQSoundCore.a \
+                  $$OUT_PWD/psflib/libpsflib.a
+
+INCLUDEPATH += QSoundCore/Core \
+               psflib
+
+SOURCES += \
+    hqbench.c \
+    hqhost.c \
+    hqplug.c
+
+HEADERS += \
+    hqhost.h \
+    hqstats.h
@@ -0,0 +1,529 @@
+/*
+    Minimal stand-in for the DeaDBeeF host, for running the decoder
+    outside of the player.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+*/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hqhost.h"
+
+struct host_meta {
+    char *key;
+    char *value;
+    struct host_meta *next;
+};
+
+typedef struct {
+    DB_playItem_t it;
+    int refcount;
+    float duration;
+    float replaygain[4];
+    struct host_meta *meta;
+} host_item_t;
+
+struct host_conf {
+    char *key;
+    char *value;
+    struct host_conf *next;
+};
+
+static struct host_conf *host_conf;
+
+static DB_playItem_t **host_playlist;
+static int host_playlist_count;
+
+static pthread_mutex_t host_pl_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static DB_FILE *
+host_fopen (const char *fname) {
+    return (DB_FILE *)fopen (fname, "rb");
+}
+
+static void
+host_fclose (DB_FILE *f) {
+    fclose ((FILE *)f);
+}
+
+static size_t
+host_fread (void *ptr, size_t size, size_t nmemb, DB_FILE *f) {
+    return fread (ptr, size, nmemb, (FILE *)f);
+}
+
+static int
+host_fseek (DB_FILE *f, int64_t offset, int whence) {
+    return fseek ((FILE *)f, offset, whence);
+}
+
+static int64_t
+host_ftell (DB_FILE *f) {
+    return ftell ((FILE *)f);
+}
+
+static int64_t
+host_fgetlength (DB_FILE *f) {
+    long pos = ftell ((FILE *)f);
+    fseek ((FILE *)f, 0, SEEK_END);
+    long len = ftell ((FILE *)f);
+    fseek ((FILE *)f, pos, SEEK_SET);
+    return len;
+}
+
+static void
+host_pl_lock (void) {
+    pthread_mutex_lock (&host_pl_mutex);
+}
+
+static void
+host_pl_unlock (void) {
+    pthread_mutex_unlock (&host_pl_mutex);
+}
+
+static const char *
+host_pl_find_meta (DB_playItem_t *it, const char *key) {
+    struct host_meta *m;
+    for (m = ((host_item_t *)it)->meta; m; m = m->next) {
+        if (!strcasecmp (m->key, key)) {
+            return m->value;
+        }
+    }
+    return NULL;
+}
+
+static void
+host_meta_add (host_item_t *item, const char *key, const char *value) {
+    struct host_meta *m = malloc (sizeof (struct host_meta));
+    m->key = strdup (key);
+    m->value = strdup (value);
+    m->next = item->meta;
+    item->meta = m;
+}
+
+// background jobs set meta while other threads read it under pl_lock, so these lock
+// like the player's do
+static void
+host_pl_add_meta (DB_playItem_t *it, const char *key, const char *value) {
+    if (!key || !value) {
+        return;
+    }
+    host_pl_lock ();
+    if (!host_pl_find_meta (it, key)) {
+        host_meta_add ((host_item_t *)it, key, value);
+    }
+    host_pl_unlock ();
+}
+
+static void
+host_pl_replace_meta (DB_playItem_t *it, const char *key, const char *value) {
+    struct host_meta *m;
+    host_pl_lock ();
+    for (m = ((host_item_t *)it)->meta; m; m = m->next) {
+        if (!strcasecmp (m->key, key)) {
+            free (m->value);
+            m->value = strdup (value);
+            host_pl_unlock ();
+            return;
+        }
+    }
+    host_meta_add ((host_item_t *)it, key, value);
+    host_pl_unlock ();
+}
+
+static DB_playItem_t *
+host_pl_item_alloc_init (const char *fname, const char *decoder_id) {
+    (void) decoder_id;
+    return hqhost_item_new (fname);
+}
+
+static void
+host_pl_item_ref (DB_playItem_t *it) {
+    __sync_fetch_and_add (&((host_item_t *)it)->refcount, 1);
+}
+
+static void
+host_pl_item_unref (DB_playItem_t *it) {
+    host_item_t *item = (host_item_t *)it;
+    if (__sync_sub_and_fetch (&item->refcount, 1)) {
+        return;
+    }
+    while (item->meta) {
+        struct host_meta *next = item->meta->next;
+        free (item->meta->key);
+        free (item->meta->value);
+        free (item->meta);
+        item->meta = next;
+    }
+    free (item);
+}
+
+// the item after it in the one playlist there is, referenced like the player does
+static DB_playItem_t *
+host_pl_get_next (DB_playItem_t *it, int iter) {
+    (void) iter;
+    DB_playItem_t *next = NULL;
+    int i;
+    host_pl_lock ();
+    for (i = 0; i + 1 < host_playlist_count; i++) {
+        if (host_playlist[i] == it) {
+            next = host_playlist[i + 1];
+            host_pl_item_ref (next);
+            break;
+        }
+    }
+    host_pl_unlock ();
+    return next;
+}
+
+static int
+host_pl_is_selected (DB_playItem_t *it) {
+    (void) it;
+    return 0;
+}
+
+static void
+host_plt_set_item_duration (ddb_playlist_t *plt, DB_playItem_t *it, float duration) {
+    (void) plt;
+    ((host_item_t *)it)->duration = duration;
+}
+
+static DB_playItem_t *
+host_plt_insert_item (ddb_playlist_t *plt, DB_playItem_t *after, DB_playItem_t *it) {
+    (void) plt;
+    (void) after;
+    host_pl_lock ();
+    host_playlist = realloc (host_playlist, (host_playlist_count + 1) * sizeof (DB_playItem_t *));
+    host_playlist[host_playlist_count++] = it;
+    host_pl_item_ref (it);
+    host_pl_unlock ();
+    return it;
+}
+
+static ddb_playlist_t *
+host_plt_get_curr (void) {
+    return NULL;
+}
+
+static void
+host_plt_ref (ddb_playlist_t *plt) {
+    (void) plt;
+}
+
+static DB_playItem_t *
+host_plt_get_first (ddb_playlist_t *plt, int iter) {
+    (void) plt;
+    (void) iter;
+    return NULL;
+}
+
+// background scans set these while the bench reads them, the player locks the same way
+static void
+host_pl_set_item_replaygain (DB_playItem_t *it, int idx, float value) {
+    host_pl_lock ();
+    ((host_item_t *)it)->replaygain[idx] = value;
+    host_pl_unlock ();
+}
+
+static float
+host_pl_get_item_replaygain (DB_playItem_t *it, int idx) {
+    host_pl_lock ();
+    float value = ((host_item_t *)it)->replaygain[idx];
+    host_pl_unlock ();
+    return value;
+}
+
+static const char *
+host_junk_detect_charset (const char *s) {
+    (void) s;
+    return NULL;
+}
+
+static int
+host_junk_iconv (const char *in, int inlen, char *out, int outlen, const char *cs_in, const char *cs_out) {
+    (void) in;
+    (void) inlen;
+    (void) out;
+    (void) outlen;
+    (void) cs_in;
+    (void) cs_out;
+    return -1;
+}
+
+static const char *
+host_conf_find (const char *key) {
+    struct host_conf *c;
+    for (c = host_conf; c; c = c->next) {
+        if (!strcmp (c->key, key)) {
+            return c->value;
+        }
+    }
+    return NULL;
+}
+
+static int
+host_conf_get_int (const char *key, int def) {
+    const char *value = host_conf_find (key);
+    return value ? atoi (value) : def;
+}
+
+static float
+host_conf_get_float (const char *key, float def) {
+    const char *value = host_conf_find (key);
+    return value ? atof (value) : def;
+}
+
+static void
+host_conf_get_str (const char *key, const char *def, char *buffer, int buffer_size) {
+    const char *value = host_conf_find (key);
+    snprintf (buffer, buffer_size, "%s", value ? value : def);
+}
+
+struct host_thread {
+    void (*fn) (void *ctx);
+    void *ctx;
+};
+
+static void *
+host_thread_entry (void *ctx) {
+    struct host_thread t = *(struct host_thread *)ctx;
+    free (ctx);
+    t.fn (t.ctx);
+    return NULL;
+}
+
+static intptr_t
+host_thread_start (void (*fn) (void *ctx), void *ctx) {
+    pthread_t tid;
+    struct host_thread *t = malloc (sizeof (struct host_thread));
+    t->fn = fn;
+    t->ctx = ctx;
+    if (pthread_create (&tid, NULL, host_thread_entry, t)) {
+        free (t);
+        return 0;
+    }
+    return (intptr_t)tid;
+}
+
+static int
+host_thread_join (intptr_t tid) {
+    return pthread_join ((pthread_t)tid, NULL);
+}
+
+static uintptr_t
+host_mutex_create (void) {
+    pthread_mutex_t *mtx = malloc (sizeof (pthread_mutex_t));
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init (&attr);
+    pthread_mutexattr_settype (&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init (mtx, &attr);
+    pthread_mutexattr_destroy (&attr);
+    return (uintptr_t)mtx;
+}
+
+static uintptr_t
+host_mutex_create_nonrecursive (void) {
+    pthread_mutex_t *mtx = malloc (sizeof (pthread_mutex_t));
+    pthread_mutex_init (mtx, NULL);
+    return (uintptr_t)mtx;
+}
+
+static void
+host_mutex_free (uintptr_t mtx) {
+    pthread_mutex_destroy ((pthread_mutex_t *)mtx);
+    free ((void *)mtx);
+}
+
+static int
+host_mutex_lock (uintptr_t mtx) {
+    return pthread_mutex_lock ((pthread_mutex_t *)mtx);
+}
+
+static int
+host_mutex_unlock (uintptr_t mtx) {
+    return pthread_mutex_unlock ((pthread_mutex_t *)mtx);
+}
+
+static uintptr_t
+host_cond_create (void) {
+    pthread_cond_t *cond = malloc (sizeof (pthread_cond_t));
+    pthread_cond_init (cond, NULL);
+    return (uintptr_t)cond;
+}
+
+static void
+host_cond_free (uintptr_t cond) {
+    pthread_cond_destroy ((pthread_cond_t *)cond);
+    free ((void *)cond);
+}
+
+static int
+host_cond_wait (uintptr_t cond, uintptr_t mtx) {
+    return pthread_cond_wait ((pthread_cond_t *)cond, (pthread_mutex_t *)mtx);
+}
+
+static int
+host_cond_signal (uintptr_t cond) {
+    return pthread_cond_signal ((pthread_cond_t *)cond);
+}
+
+static int
+host_cond_broadcast (uintptr_t cond) {
+    return pthread_cond_broadcast ((pthread_cond_t *)cond);
+}
+
+static const char *
+host_get_config_dir (void) {
+    static char dir[1024];
+    if (!dir[0]) {
+        const char *xdg = getenv ("XDG_CONFIG_HOME");
+        const char *home = getenv ("HOME");
+        if (xdg) {
+            snprintf (dir, sizeof (dir), "%s/deadbeef", xdg);
+        }
+        else {
+            snprintf (dir, sizeof (dir), "%s/.config/deadbeef", home ? home : ".");
+        }
+    }
+    return dir;
+}
+
+static DB_functions_t host_api = {
+    .fopen = host_fopen,
+    .fclose = host_fclose,
+    .fread = host_fread,
+    .fseek = host_fseek,
+    .ftell = host_ftell,
+    .fgetlength = host_fgetlength,
+    .pl_lock = host_pl_lock,
+    .pl_unlock = host_pl_unlock,
+    .pl_find_meta = host_pl_find_meta,
+    .pl_add_meta = host_pl_add_meta,
+    .pl_replace_meta = host_pl_replace_meta,
+    .pl_item_alloc_init = host_pl_item_alloc_init,
+    .pl_item_ref = host_pl_item_ref,
+    .pl_item_unref = host_pl_item_unref,
+    .pl_get_next = host_pl_get_next,
+    .pl_is_selected = host_pl_is_selected,
+    .plt_set_item_duration = host_plt_set_item_duration,
+    .plt_insert_item = host_plt_insert_item,
+    .plt_get_curr = host_plt_get_curr,
+    .plt_ref = host_plt_ref,
+    .plt_unref = host_plt_ref,
+    .plt_get_first = host_plt_get_first,
+    .pl_set_item_replaygain = host_pl_set_item_replaygain,
+    .pl_get_item_replaygain = host_pl_get_item_replaygain,
+    .junk_detect_charset = host_junk_detect_charset,
+    .junk_iconv = host_junk_iconv,
+    .conf_get_int = host_conf_get_int,
+    .conf_get_float = host_conf_get_float,
+    .conf_get_str = host_conf_get_str,
+    .thread_start = host_thread_start,
+    .thread_start_low_priority = host_thread_start,
+    .thread_join = host_thread_join,
+    .mutex_create = host_mutex_create,
+    .mutex_create_nonrecursive = host_mutex_create_nonrecursive,
+    .mutex_free = host_mutex_free,
+    .mutex_lock = host_mutex_lock,
+    .mutex_unlock = host_mutex_unlock,
+    .cond_create = host_cond_create,
+    .cond_free = host_cond_free,
+    .cond_wait = host_cond_wait,
+    .cond_signal = host_cond_signal,
+    .cond_broadcast = host_cond_broadcast,
+    .get_config_dir = host_get_config_dir,
+};
+
+void
+hqhost_init (void) {
+    hq_load (&host_api);
+    hq_plugin.plugin.start ();
+}
+
+void
+hqhost_shutdown (void) {
+    hq_plugin.plugin.stop ();
+    hqhost_playlist_clear ();
+}
+
+void
+hqhost_conf_set (const char *key, const char *value) {
+    struct host_conf *c;
+    for (c = host_conf; c; c = c->next) {
+        if (!strcmp (c->key, key)) {
+            free (c->value);
+            c->value = strdup (value);
+            return;
+        }
+    }
+    c = malloc (sizeof (struct host_conf));
+    c->key = strdup (key);
+    c->value = strdup (value);
+    c->next = host_conf;
+    host_conf = c;
+}
+
+DB_playItem_t *
+hqhost_item_new (const char *uri) {
+    host_item_t *item = calloc (1, sizeof (host_item_t));
+    item->refcount = 1;
+    host_pl_add_meta (&item->it, ":URI", uri);
+    return &item->it;
+}
+
+void
+hqhost_item_free (DB_playItem_t *it) {
+    host_pl_item_unref (it);
+}
+
+int
+hqhost_playlist_count (void) {
+    return host_playlist_count;
+}
+
+DB_playItem_t *
+hqhost_playlist_get (int idx) {
+    return host_playlist[idx];
+}
+
+float
+hqhost_item_duration (DB_playItem_t *it) {
+    return ((host_item_t *)it)->duration;
+}
+
+const char *
+hqhost_item_meta (DB_playItem_t *it, const char *key) {
+    host_pl_lock ();
+    const char *value = host_pl_find_meta (it, key);
+    host_pl_unlock ();
+    return value;
+}
+
+float
+hqhost_item_replaygain (DB_playItem_t *it, int idx) {
+    return host_pl_get_item_replaygain (it, idx);
+}
+
+void
+hqhost_playlist_clear (void) {
+    int i;
+    for (i = 0; i < host_playlist_count; i++) {
+        host_pl_item_unref (host_playlist[i]);
+    }
+    free (host_playlist);
+    host_playlist = NULL;
+    host_playlist_count = 0;
+}
+
+double
+hqhost_time (void) {
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
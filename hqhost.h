@@ -0,0 +1,48 @@
+/*
+    Minimal stand-in for the DeaDBeeF host, for running the decoder
+    outside of the player.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+*/
+
+#ifndef HQHOST_H
+#define HQHOST_H
+
+#include <deadbeef/deadbeef.h>
+
+#include "hqstats.h"
+
+extern DB_decoder_t hq_plugin;
+DB_plugin_t * hq_load (DB_functions_t *api);
+
+// ROM image memory: bytes in mappings and on the heap, the page size of the last mapping
+// (0 if none) and page faults taken while loading images
+void hq_rom_arena_stats (size_t *mapped, size_t *heap, int *page_size, long *faults);
+
+// set up the host API, load and start the plugin
+void hqhost_init (void);
+void hqhost_shutdown (void);
+
+// configuration seen by the plugin through conf_get_*
+void hqhost_conf_set (const char *key, const char *value);
+
+// playlist items only carry metadata, :URI among it
+DB_playItem_t * hqhost_item_new (const char *uri);
+void hqhost_item_free (DB_playItem_t *it);
+
+// items the plugin inserted, in insertion order
+int hqhost_playlist_count (void);
+DB_playItem_t * hqhost_playlist_get (int idx);
+float hqhost_item_duration (DB_playItem_t *it);
+const char * hqhost_item_meta (DB_playItem_t *it, const char *key);
+// DDB_REPLAYGAIN_* value as set by the plugin, 0 if it was never set
+float hqhost_item_replaygain (DB_playItem_t *it, int idx);
+void hqhost_playlist_clear (void);
+
+// monotonic clock, in seconds
+double hqhost_time (void);
+
+#endif
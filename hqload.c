@@ -0,0 +1,225 @@
+/*
+    hqload - how many QSF streams the multi-stream server keeps in real time
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hqhost.h"
+#include "hqserver.h"
+
+static void
+usage (void) {
+    fprintf (stderr,
+        "usage: hqload [options] file...\n"
+        "  -j threads     worker threads, one per core (default: one per CPU)\n"
+        "  -b frames      frames rendered at a time (default 4096)\n"
+        "  -q blocks      blocks a stream may get ahead of its reader (default 4)\n"
+        "  -d seconds     how long each stream count is played (default 5)\n"
+        "  -p ms          time from opening a stream to its first frame being due (default 500)\n"
+        "  -n streams     stop searching at this many streams (default 4096)\n"
+        "  -o key=value   set a plugin option\n"
+        "streams play the files in turn; the search doubles the stream count until a\n"
+        "block is late or a reader runs dry, then narrows down on the largest count that kept up\n");
+    exit (1);
+}
+
+typedef struct {
+    hqstream_t *stream;
+    double start;
+    long consumed;              // bytes read
+    long byte_rate;
+    int ended;
+} load_stream_t;
+
+typedef struct {
+    long underruns;             // reads that found less than was due
+    int failed;                 // streams that didn't open
+    hqserver_stats_t stats;
+} load_result_t;
+
+static int threads, block_frames = 4096, queue_blocks = 4;
+static double seconds = 5, preroll = 0.5;
+
+static DB_playItem_t **items;
+static int item_count;
+
+// plays count streams in real time, reading each one every 10 ms what it owes by then
+static void
+run_load (int count, load_result_t *res) {
+    memset (res, 0, sizeof (load_result_t));
+    hqserver_t *server = hqserver_create (threads, block_frames, queue_blocks);
+    load_stream_t *streams = calloc (count, sizeof (load_stream_t));
+    int i;
+    for (i = 0; i < count; i++) {
+        load_stream_t *ls = &streams[i];
+        ls->start = hqhost_time () + preroll;
+        ls->stream = hqserver_open (server, items[i % item_count], ls->start);
+        if (!ls->stream) {
+            res->failed++;
+            ls->ended = 1;
+            continue;
+        }
+        const ddb_waveformat_t *fmt = hqserver_format (ls->stream);
+        ls->byte_rate = (long)fmt->samplerate * fmt->channels * fmt->bps / 8;
+    }
+
+    static char scratch[65536];
+    double end = hqhost_time () + seconds;
+    double now;
+    while ((now = hqhost_time ()) < end) {
+        for (i = 0; i < count; i++) {
+            load_stream_t *ls = &streams[i];
+            if (ls->ended || now < ls->start) {
+                continue;
+            }
+            long due = (long)(( now - ls->start ) * ls->byte_rate) - ls->consumed;
+            while (due > 0) {
+                int rd = hqserver_read (ls->stream, scratch, due < (long)sizeof (scratch) ? (int)due : (int)sizeof (scratch), 0);
+                if (rd < 0) {
+                    ls->ended = 1;
+                    break;
+                }
+                if (rd == 0) {
+                    res->underruns++;
+                    break;
+                }
+                ls->consumed += rd;
+                due -= rd;
+            }
+        }
+        usleep (10000);
+    }
+
+    for (i = 0; i < count; i++) {
+        if (streams[i].stream) {
+            hqserver_close (streams[i].stream);
+        }
+    }
+    hqserver_stats (server, &res->stats);
+    threads = hqserver_threads (server);
+    hqserver_destroy (server);
+    free (streams);
+}
+
+static int
+try_count (int count) {
+    load_result_t res;
+    run_load (count, &res);
+    int ok = !res.underruns && !res.stats.missed && !res.failed;
+    printf ("%6d streams: %ld blocks, %ld late (worst %.1f ms), %ld underruns, workers %.0f%% busy%s\n",
+            count, res.stats.blocks, res.stats.missed, res.stats.worst_late * 1000, res.underruns,
+            100 * res.stats.busy / ( threads * seconds ), ok ? "" : "  - missed");
+    if (res.failed) {
+        printf ("        %d streams failed to open\n", res.failed);
+    }
+    fflush (stdout);
+    return ok;
+}
+
+int
+main (int argc, char **argv) {
+    int max_count = 4096;
+    int opt;
+
+    while ((opt = getopt (argc, argv, "j:b:q:d:p:n:o:")) != -1) {
+        switch (opt) {
+        case 'j':
+            threads = atoi (optarg);
+            break;
+        case 'b':
+            block_frames = atoi (optarg);
+            break;
+        case 'q':
+            queue_blocks = atoi (optarg);
+            break;
+        case 'd':
+            seconds = atof (optarg);
+            break;
+        case 'p':
+            preroll = atof (optarg) / 1000;
+            break;
+        case 'n':
+            max_count = atoi (optarg);
+            break;
+        case 'o': {
+            char *eq = strchr (optarg, '=');
+            if (!eq) {
+                usage ();
+            }
+            *eq = 0;
+            hqhost_conf_set (optarg, eq + 1);
+            break;
+        }
+        default:
+            usage ();
+        }
+    }
+    if (optind >= argc || block_frames <= 0 || queue_blocks < 2 || seconds <= 0 || max_count <= 0) {
+        usage ();
+    }
+
+    hqhost_init ();
+
+    int i;
+    for (i = optind; i < argc; i++) {
+        hq_plugin.insert (NULL, NULL, argv[i]);
+    }
+    item_count = hqhost_playlist_count ();
+    if (!item_count) {
+        fprintf (stderr, "no tracks\n");
+        hqhost_shutdown ();
+        return 1;
+    }
+    items = malloc (item_count * sizeof (DB_playItem_t *));
+    for (i = 0; i < item_count; i++) {
+        items[i] = hqhost_playlist_get (i);
+    }
+
+    // double until a count misses, then bisect between the last good one and it
+    int good = 0, bad = 0, count = 1;
+    while (count <= max_count) {
+        if (!try_count (count)) {
+            bad = count;
+            break;
+        }
+        good = count;
+        count *= 2;
+    }
+    if (!bad && good < max_count) {
+        if (try_count (max_count)) {
+            good = max_count;
+        }
+        else {
+            bad = max_count;
+        }
+    }
+    while (bad && bad - good > 1 && bad - good > good / 32) {
+        count = good + ( bad - good ) / 2;
+        if (try_count (count)) {
+            good = count;
+        }
+        else {
+            bad = count;
+        }
+    }
+
+    if (good) {
+        printf ("%d real-time streams%s on %d threads, %.1f per core\n", good, bad ? "" : " or more",
+                threads, (double)good / threads);
+    }
+    else {
+        printf ("not even one stream kept up on %d threads\n", threads);
+    }
+
+    free (items);
+    hqhost_shutdown ();
+    return good ? 0 : 1;
+}
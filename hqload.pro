@@ -0,0 +1,42 @@
+#-------------------------------------------------
+#
+# Load test for the multi-stream server: how many
+# streams stay real-time per core, on a stub host
+#
+#-------------------------------------------------
+
+QT       -= core gui
+
+TARGET = hqload
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle qt
+
+DEFINES += _GNU_SOURCE
+
+QMAKE_CFLAGS += -std=c99 -ftree-vectorize
+
+LIBS += -L$$OUT_PWD/QSoundCore/Core/ \
+        -L$$OUT_PWD/psflib/
+
+LIBS += -lpsflib -lQSoundCore -lz -lpthread -lm
+
+DEPENDPATH += $$PWD/QSoundCore/Core \
+              $$PWD/psflib
+
+PRE_TARGETDEPS += $$OUT_PWD/QSoundCore/Core/libQSoundCore.a \
+                  $$OUT_PWD/psflib/libpsflib.a
+
+INCLUDEPATH += QSoundCore/Core \
+               psflib
+
+SOURCES += \
+    hqload.c \
+    hqserver.c \
+    hqhost.c \
+    hqplug.c
+
+HEADERS += \
+    hqhost.h \
+    hqserver.h \
+    hqstats.h
@@ -18,14 +18,31 @@
 */
 
 #include <linux/limits.h>
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <time.h>
+#include <utime.h>
+#include <unistd.h>
 #include <deadbeef/deadbeef.h>
 
 #include "QSoundCore/Core/qsound.h"
 
 #include <psflib.h>
 
+#if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+#define HQ_X86
+#include <immintrin.h>
+#endif
+
+#include "hqstats.h"
+
 # define strdup(s)							      \
   (__extension__							      \
     ({									      \
@@ -40,6 +57,13 @@ extern DB_decoder_t hq_plugin;
 #define trace(...) { fprintf(stderr, __VA_ARGS__); }
 //#define trace(fmt,...)
 
+// instrumentation, gone entirely unless built with HQ_STATS
+#ifdef HQ_STATS
+#define HQ_STAT(x) x
+#else
+#define HQ_STAT(x)
+#endif
+
 static DB_functions_t *deadbeef;
 
 #define min(x,y) ((x)<(y)?(x):(y))
@@ -69,130 +93,103 @@ inline unsigned get_be32( void const* p )
             (unsigned) ((unsigned char const*) p) [3];
 }
 
+#define HASH_SEED 0xcbf29ce484222325ULL
+
+static uint64_t hash_data( uint64_t h, const void * data, size_t size )
+{
+    const uint8_t * p = data;
+    while ( size >= 8 ) {
+        uint64_t w;
+        memcpy( &w, p, 8 );
+        h = ( ( h ^ w ) * 0x9e3779b97f4a7c15ULL ) ^ ( h >> 29 );
+        p += 8;
+        size -= 8;
+    }
+    while ( size-- ) h = ( ( h ^ *p++ ) * 0x100000001b3ULL ) ^ ( h >> 29 );
+    return h;
+}
+
+static unsigned long parse_digits(const char *start, const char *end)
+{
+    unsigned long value = 0;
+    while (start < end) value = value * 10 + (*start++ - '0');
+    return value;
+}
+
+// [[hours:]minutes:]seconds[.fraction], read right to left in place
 static unsigned long parse_time_crap(const char *input)
 {
-    if (!input) return BORK_TIME;
-    int len = strlen(input);
-    if (!len) return BORK_TIME;
-    int value = 0;
+    static const unsigned long scale[3] = { 1000, 60000, 3600000 };
+
+    if (!input || !*input) return BORK_TIME;
+
+    const char *p;
+    for (p = input; *p; p++)
     {
-        int i;
-        for (i = len - 1; i >= 0; i--)
+        if ((*p < '0' || *p > '9') && *p != ':' && *p != ',' && *p != '.')
         {
-            if ((input[i] < '0' || input[i] > '9') && input[i] != ':' && input[i] != ',' && input[i] != '.')
-            {
-                return BORK_TIME;
-            }
+            return BORK_TIME;
         }
     }
 
-    char * foo = strdup( input );
-
-    if ( !foo )
-        return BORK_TIME;
+    const char *end = p;
+    unsigned long value = 0;
 
-    char * bar = foo;
-    char * strs = bar + strlen( foo ) - 1;
-    char * end;
-    while (strs > bar && (*strs >= '0' && *strs <= '9'))
+    while (p > input && p[-1] >= '0' && p[-1] <= '9') p--;
+    if (p > input && (p[-1] == '.' || p[-1] == ','))
     {
-        strs--;
-    }
-    if (*strs == '.' || *strs == ',')
-    {
-        // fraction of a second
-        strs++;
-        if (strlen(strs) > 3) strs[3] = 0;
-        value = strtoul(strs, &end, 10);
-        switch (strlen(strs))
+        // fraction of a second, to the millisecond
+        int digits = 0;
+        while (digits < 3)
         {
-        case 1:
-            value *= 100;
-            break;
-        case 2:
-            value *= 10;
-            break;
+            value = value * 10 + (p + digits < end ? p[digits] - '0' : 0);
+            digits++;
         }
-        strs--;
-        *strs = 0;
-        strs--;
+        end = --p;
+        while (p > input && p[-1] >= '0' && p[-1] <= '9') p--;
     }
-    while (strs > bar && (*strs >= '0' && *strs <= '9'))
-    {
-        strs--;
-    }
-    // seconds
-    if (*strs < '0' || *strs > '9') strs++;
-    value += strtoul(strs, &end, 10) * 1000;
-    if (strs > bar)
+
+    int field;
+    for (field = 0; field < 3; field++)
     {
-        strs--;
-        *strs = 0;
-        strs--;
-        while (strs > bar && (*strs >= '0' && *strs <= '9'))
-        {
-            strs--;
-        }
-        if (*strs < '0' || *strs > '9') strs++;
-        value += strtoul(strs, &end, 10) * 60000;
-        if (strs > bar)
-        {
-            strs--;
-            *strs = 0;
-            strs--;
-            while (strs > bar && (*strs >= '0' && *strs <= '9'))
-            {
-                strs--;
-            }
-            value += strtoul(strs, &end, 10) * 3600000;
-        }
+        value += parse_digits(p, end) * scale[field];
+        if (p == input) break;
+        end = --p;
+        while (p > input && p[-1] >= '0' && p[-1] <= '9') p--;
     }
-    free( foo );
     return value;
 }
 
-struct psf_tag
+/* ROM images loaded from one _lib, shared by every track of the set */
+struct hq_rom_set
 {
-    char * name;
-    char * value;
-    struct psf_tag * next;
-};
+    struct hq_rom_set * next;
 
-static struct psf_tag * add_tag( struct psf_tag * tags, const char * name, const char * value )
-{
-    struct psf_tag * tag = malloc( sizeof( struct psf_tag ) );
-    if ( !tag ) return tags;
+    char * path;
+    time_t mtime;
+    off_t size;
 
-    tag->name = strdup( name );
-    if ( !tag->name ) {
-        free( tag );
-        return tags;
-    }
-    tag->value = strdup( value );
-    if ( !tag->value ) {
-        free( tag->name );
-        free( tag );
-        return tags;
-    }
-    tag->next = tags;
-    return tag;
-}
+    // file mapping the images point into when they came from a bundle
+    uint8_t * bundle;
+    size_t bundle_size;
 
-static void free_tags( struct psf_tag * tags )
-{
-    struct psf_tag * tag, * next;
+    // rom_set_hash of the images, once somebody needed it
+    uint64_t hash;
+    int hashed;
 
-    tag = tags;
+    int refcount;
 
-    while ( tag )
-    {
-        next = tag->next;
-        free( tag->name );
-        free( tag->value );
-        free( tag );
-        tag = next;
-    }
-}
+    uint8_t * key;
+    uint32_t key_size;
+
+    uint8_t * z80;
+    uint32_t z80_size;
+
+    uint8_t * samples;
+    uint32_t samples_size;
+
+    void * emu_template;
+};
 
 struct psf_load_state
 {
@@ -210,9 +207,81 @@ struct psf_load_state
 
     int utf8;
 
-    struct psf_tag *tags;
+    // name\0value\0 pairs in file order, in one buffer that grows by doubling
+    char *tags;
+    uint32_t tags_size;
+    uint32_t tags_max;
+    int tag_count;
+
+    char lib_path[PATH_MAX];
+
+    const struct hq_rom_set * base;
+    // of the sections loaded over base, in load order
+    uint64_t patch_hash;
 };
 
+#define PSF_TAG_MAX 50000
+
+// find the _lib tag of a QSF from its header and tag area alone, without reading the
+// program data; -1 when the file is not a QSF
+static int qsf_read_lib( const char * uri, char * lib_path )
+{
+    uint8_t header[16];
+    lib_path[0] = 0;
+
+    DB_FILE * f = deadbeef->fopen( uri );
+    if ( !f ) return -1;
+    if ( deadbeef->fread( header, 1, 16, f ) != 16 || memcmp( header, "PSF\x41", 4 ) ) {
+        deadbeef->fclose( f );
+        return -1;
+    }
+
+    char * tags = NULL;
+    int64_t tag_start = 16 + (int64_t) get_le32( header + 4 ) + get_le32( header + 8 );
+    int64_t tag_size = deadbeef->fgetlength( f ) - tag_start;
+    if ( tag_size > 5 && deadbeef->fseek( f, tag_start, SEEK_SET ) == 0 ) {
+        if ( tag_size > PSF_TAG_MAX + 5 ) tag_size = PSF_TAG_MAX + 5;
+        tags = malloc( tag_size + 1 );
+        if ( tags && deadbeef->fread( tags, 1, tag_size, f ) == (size_t) tag_size && !memcmp( tags, "[TAG]", 5 ) ) {
+            tags[ tag_size ] = 0;
+        }
+        else {
+            free( tags );
+            tags = NULL;
+        }
+    }
+    deadbeef->fclose( f );
+    if ( !tags ) return 0;
+
+    // name=value lines, whitespace around either is not part of it
+    char * line = tags + 5;
+    while ( *line ) {
+        char * next = strchr( line, '\n' );
+        if ( next ) *next++ = 0;
+        else next = line + strlen( line );
+
+        char * eq = strchr( line, '=' );
+        if ( eq ) {
+            char * name = line;
+            char * value = eq + 1;
+            char * end = eq;
+            while ( *name && (uint8_t) *name <= ' ' ) name++;
+            while ( end > name && (uint8_t) end[-1] <= ' ' ) end--;
+            if ( end - name == 4 && !strncasecmp( name, "_lib", 4 ) ) {
+                while ( *value && (uint8_t) *value <= ' ' ) value++;
+                end = value + strlen( value );
+                while ( end > value && (uint8_t) end[-1] <= ' ' ) end--;
+                *end = 0;
+                strncpy( lib_path, value, PATH_MAX - 1 );
+                lib_path[ PATH_MAX - 1 ] = 0;
+            }
+        }
+        line = next;
+    }
+    free( tags );
+    return 0;
+}
+
 static int psf_info_meta(void * context, const char * name, const char * value)
 {
     struct psf_load_state * state = ( struct psf_load_state * ) context;
@@ -231,6 +300,25 @@ static int psf_info_meta(void * context, const char * name, const char * value)
     return 0;
 }
 
+static void tag_append( struct psf_load_state * state, const char * name, const char * value )
+{
+    size_t name_size = strlen( name ) + 1;
+    size_t value_size = strlen( value ) + 1;
+    size_t need = state->tags_size + name_size + value_size;
+    if ( need > state->tags_max ) {
+        size_t max = state->tags_max ? state->tags_max : 1024;
+        while ( max < need ) max *= 2;
+        char * tags = realloc( state->tags, max );
+        if ( !tags ) return;
+        state->tags = tags;
+        state->tags_max = max;
+    }
+    memcpy( state->tags + state->tags_size, name, name_size );
+    memcpy( state->tags + state->tags_size + name_size, value, value_size );
+    state->tags_size = need;
+    state->tag_count++;
+}
+
 static int psf_info_dump(void * context, const char * name, const char * value)
 {
     struct psf_load_state * state = ( struct psf_load_state * ) context;
@@ -256,89 +344,327 @@ static int psf_info_dump(void * context, const char * name, const char * value)
         else if ( !strcasecmp( name, "tracknumber" ) ) name = "track";
         else if ( !strcasecmp( name, "discnumber" ) ) name = "disc";
 
-        state->tags = add_tag( state->tags, name, value );
+        tag_append( state, name, value );
     }
 
     return 0;
 }
 
-static int upload_section( struct psf_load_state * state, const char * section, uint32_t start,
-                           const uint8_t * data, uint32_t size )
+// ROM image storage. With hq.rom_arena set, large images get an anonymous mapping of their
+// own so they can sit on huge pages (2 asks for hugetlbfs pages, 1 for transparent ones)
+// and be made read-only once the cache shares them; small images and hq.rom_arena=0 use the
+// heap. A header in front of the data says which, so images can be grown and freed alike
+#define ROM_HEADER 64
+#define ROM_MAP_MIN ( 256 * 1024 )
+#define ROM_HUGE_PAGE ( 2 * 1024 * 1024 )
+
+struct rom_header
 {
-    uint8_t ** array = NULL;
-    uint32_t * array_size = NULL;
-    uint32_t max_size = 0x7fffffff;
+    size_t capacity;
+    size_t map_size;    // 0 for heap images
+    uint8_t * map;
+    int page_size;
+};
 
-    if ( !strcmp( section, "KEY" ) ) { array = &state->key; array_size = &state->key_size; max_size = 11; }
-    else if ( !strcmp( section, "Z80" ) ) { array = &state->z80_rom; array_size = &state->z80_size; }
-    else if ( !strcmp( section, "SMP" ) ) { array = &state->sample_rom; array_size = &state->sample_size; }
-    else return -1;
+static struct
+{
+    size_t mapped;
+    size_t heap;
+    int page_size;      // of the last image mapped, 0 while all are on the heap
+    long faults;        // page faults taken while loading ROM images
+} rom_arena;
 
-    if ( ( start + size ) < start ) return -1;
+static struct rom_header * rom_image_header( uint8_t * data )
+{
+    return ( struct rom_header * ) ( data - ROM_HEADER );
+}
 
-    uint32_t new_size = start + size;
-    uint32_t old_size = *array_size;
-    if ( new_size > max_size ) return -1;
+static uint8_t * rom_image_map( size_t size, int mode, int prefault )
+{
+    int populate = prefault ? MAP_POPULATE : 0;
+    size_t page = sysconf( _SC_PAGESIZE );
+    size_t map_size;
+    uint8_t * map = MAP_FAILED;
+    int page_size = page;
 
-    if ( new_size > old_size ) {
-        *array = realloc( *array, new_size );
-        *array_size = new_size;
-        memset( *array + old_size, 0, new_size - old_size );
+    if ( mode >= 2 ) {
+        map_size = ( size + ROM_HUGE_PAGE - 1 ) & ~(size_t)( ROM_HUGE_PAGE - 1 );
+        map = mmap( NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | populate, -1, 0 );
+        if ( map != MAP_FAILED ) page_size = ROM_HUGE_PAGE;
+    }
+    if ( map == MAP_FAILED && size >= ROM_HUGE_PAGE ) {
+        // over-map and trim to a huge page boundary, or the kernel can't back it with huge pages
+        map_size = ( size + ROM_HUGE_PAGE - 1 ) & ~(size_t)( ROM_HUGE_PAGE - 1 );
+        uint8_t * raw = mmap( NULL, map_size + ROM_HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+        if ( raw != MAP_FAILED ) {
+            size_t head = ( ROM_HUGE_PAGE - ( (uintptr_t) raw & ( ROM_HUGE_PAGE - 1 ) ) ) & ( ROM_HUGE_PAGE - 1 );
+            if ( head ) munmap( raw, head );
+            munmap( raw + head + map_size, ROM_HUGE_PAGE - head );
+            map = raw + head;
+#ifdef MADV_HUGEPAGE
+            if ( !madvise( map, map_size, MADV_HUGEPAGE ) ) page_size = ROM_HUGE_PAGE;
+#endif
+            if ( prefault ) madvise( map, map_size, MADV_WILLNEED );
+        }
+    }
+    if ( map == MAP_FAILED ) {
+        map_size = ( size + page - 1 ) & ~( page - 1 );
+        map = mmap( NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | populate, -1, 0 );
+        if ( map == MAP_FAILED ) return NULL;
     }
 
-    memcpy( *array + start, data, size );
+    struct rom_header * header = ( struct rom_header * ) map;
+    header->capacity = map_size - ROM_HEADER;
+    header->map_size = map_size;
+    header->map = map;
+    header->page_size = page_size;
+    __atomic_add_fetch( &rom_arena.mapped, map_size, __ATOMIC_RELAXED );
+    __atomic_store_n( &rom_arena.page_size, page_size, __ATOMIC_RELAXED );
+    return map + ROM_HEADER;
+}
 
-    return 0;
+static uint8_t * rom_image_alloc( size_t size )
+{
+    int mode = deadbeef->conf_get_int( "hq.rom_arena", 1 );
+    if ( mode > 0 && size + ROM_HEADER >= ROM_MAP_MIN ) {
+        uint8_t * data = rom_image_map( size + ROM_HEADER, mode, deadbeef->conf_get_int( "hq.rom_prefault", 0 ) );
+        if ( data ) return data;
+    }
+
+    uint8_t * map = malloc( size + ROM_HEADER );
+    if ( !map ) return NULL;
+    struct rom_header * header = ( struct rom_header * ) map;
+    header->capacity = size;
+    header->map_size = 0;
+    header->map = map;
+    header->page_size = 0;
+    __atomic_add_fetch( &rom_arena.heap, size, __ATOMIC_RELAXED );
+    return map + ROM_HEADER;
+}
+
+static void rom_image_free( uint8_t * data )
+{
+    if ( !data ) return;
+    struct rom_header * header = rom_image_header( data );
+    if ( header->map_size ) {
+        size_t map_size = header->map_size;
+        __atomic_sub_fetch( &rom_arena.mapped, map_size, __ATOMIC_RELAXED );
+        munmap( header->map, map_size );
+    }
+    else {
+        __atomic_sub_fetch( &rom_arena.heap, header->capacity, __ATOMIC_RELAXED );
+        free( header->map );
+    }
+}
+
+// keeps the first size bytes; NULL on failure, with the image left as it was
+static uint8_t * rom_image_grow( uint8_t * data, size_t size, size_t new_size )
+{
+    if ( data && new_size <= rom_image_header( data )->capacity ) return data;
+    uint8_t * grown = rom_image_alloc( new_size );
+    if ( !grown ) return NULL;
+    if ( data ) {
+        memcpy( grown, data, size );
+        rom_image_free( data );
+    }
+    return grown;
+}
+
+// loading is over: the voice mixer reads sample data at scattered offsets, and images the
+// cache hands out must not change under their users
+static void rom_image_settle( uint8_t * data, int random, int readonly )
+{
+    if ( !data ) return;
+    struct rom_header * header = rom_image_header( data );
+    if ( !header->map_size ) return;
+    if ( random ) madvise( header->map, header->map_size, MADV_RANDOM );
+    if ( readonly ) mprotect( header->map, header->map_size, PROT_READ );
 }
 
+static long rom_faults_now( void )
+{
+    struct rusage ru;
+    if ( getrusage( RUSAGE_THREAD, &ru ) < 0 ) return 0;
+    return ru.ru_minflt + ru.ru_majflt;
+}
+
+// for benchmarks comparing the mapped and heap paths
+void hq_rom_arena_stats( size_t * mapped, size_t * heap, int * page_size, long * faults )
+{
+    *mapped = __atomic_load_n( &rom_arena.mapped, __ATOMIC_RELAXED );
+    *heap = __atomic_load_n( &rom_arena.heap, __ATOMIC_RELAXED );
+    *page_size = __atomic_load_n( &rom_arena.page_size, __ATOMIC_RELAXED );
+    *faults = __atomic_load_n( &rom_arena.faults, __ATOMIC_RELAXED );
+}
+
+enum { IMAGE_KEY, IMAGE_Z80, IMAGE_SMP, IMAGE_COUNT };
+
+static int section_image( const char * section )
+{
+    if ( !strcmp( section, "KEY" ) ) return IMAGE_KEY;
+    if ( !strcmp( section, "Z80" ) ) return IMAGE_Z80;
+    if ( !strcmp( section, "SMP" ) ) return IMAGE_SMP;
+    return -1;
+}
+
+static void section_slot( struct psf_load_state * state, int image, uint8_t *** array, uint32_t ** array_size,
+                          const uint8_t ** shared )
+{
+    const struct hq_rom_set * base = state->base;
+    switch ( image ) {
+    case IMAGE_KEY: *array = &state->key; *array_size = &state->key_size; *shared = base ? base->key : NULL; break;
+    case IMAGE_Z80: *array = &state->z80_rom; *array_size = &state->z80_size; *shared = base ? base->z80 : NULL; break;
+    default: *array = &state->sample_rom; *array_size = &state->sample_size; *shared = base ? base->samples : NULL; break;
+    }
+}
+
+// step over one section header, 0 at the end of the exe and -1 when it is malformed
+static int qsf_next_section( const uint8_t ** exe, size_t * exe_size, int * image, uint32_t * start, uint32_t * size )
+{
+    char s[4];
+    if ( *exe_size < 11 ) return 0;
+    memcpy( s, *exe, 3 );
+    s[3] = 0;
+    *start = get_le32( *exe + 3 );
+    *size = get_le32( *exe + 7 );
+    *exe += 11;
+    *exe_size -= 11;
+    if ( *size > *exe_size ) return -1;
+    if ( ( *start + *size ) < *start ) return -1;
+    *image = section_image( s );
+    if ( *image < 0 ) return -1;
+    if ( *image == IMAGE_KEY && *start + *size > 11 ) return -1;
+    return 1;
+}
+
+// sections are scanned first so every image is sized once for this exe, then copied into place
 int qsf_load(void * context, const uint8_t * exe, size_t exe_size,
                                   const uint8_t * reserved, size_t reserved_size)
 {
     struct psf_load_state * state = ( struct psf_load_state * ) context;
 
-    for (;;) {
-        char s[4];
-        if ( exe_size < 11 ) break;
-        memcpy( s, exe, 3 ); exe += 3; exe_size -= 3;
-        s [3] = 0;
-        uint32_t dataofs  = get_le32( exe ); exe += 4; exe_size -= 4;
-        uint32_t datasize = get_le32( exe ); exe += 4; exe_size -= 4;
-        if ( datasize > exe_size )
-            return -1;
+    uint32_t extent[ IMAGE_COUNT ] = { 0 };
+    int touched[ IMAGE_COUNT ] = { 0 };
+    int covered[ IMAGE_COUNT ] = { 0 };
+    const uint8_t * p;
+    size_t left;
+    int image, rc;
+    uint32_t start, size;
 
-        if ( upload_section( state, s, dataofs, exe, datasize ) < 0 )
-            return -1;
+    for ( p = exe, left = exe_size; ( rc = qsf_next_section( &p, &left, &image, &start, &size ) ) > 0; p += size, left -= size ) {
+        touched[ image ] = 1;
+        if ( start + size > extent[ image ] ) extent[ image ] = start + size;
+    }
+    if ( rc < 0 ) return -1;
+
+    // growth that one section fills from the old end onwards needs no clearing
+    for ( p = exe, left = exe_size; qsf_next_section( &p, &left, &image, &start, &size ) > 0; p += size, left -= size ) {
+        uint8_t ** array;
+        uint32_t * array_size;
+        const uint8_t * shared;
+        section_slot( state, image, &array, &array_size, &shared );
+        if ( start <= *array_size && start + size == extent[ image ] ) covered[ image ] = 1;
+    }
+
+    for ( image = 0; image < IMAGE_COUNT; image++ ) {
+        if ( !touched[ image ] ) continue;
+
+        uint8_t ** array;
+        uint32_t * array_size;
+        const uint8_t * shared;
+        section_slot( state, image, &array, &array_size, &shared );
+
+        uint32_t old_size = *array_size;
+        uint32_t new_size = max( extent[ image ], old_size );
+
+        if ( shared && *array == shared ) {
+            // first write over a cached image, take a private copy of it
+            uint8_t * copy = rom_image_alloc( new_size );
+            if ( !copy ) return -1;
+            memcpy( copy, shared, old_size );
+            *array = copy;
+        }
+        else if ( new_size > old_size ) {
+            uint8_t * grown = rom_image_grow( *array, old_size, new_size );
+            if ( !grown ) return -1;
+            *array = grown;
+        }
+
+        if ( new_size > old_size && !covered[ image ] ) {
+            memset( *array + old_size, 0, new_size - old_size );
+        }
+        *array_size = new_size;
+    }
 
-        exe += datasize;
-        exe_size -= datasize;
+    for ( p = exe, left = exe_size; qsf_next_section( &p, &left, &image, &start, &size ) > 0; p += size, left -= size ) {
+        uint8_t ** array;
+        uint32_t * array_size;
+        const uint8_t * shared;
+        section_slot( state, image, &array, &array_size, &shared );
+        memcpy( *array + start, p, size );
+        if ( state->base ) {
+            uint32_t where[3] = { image, start, size };
+            state->patch_hash = hash_data( hash_data( state->patch_hash, where, sizeof( where ) ), p, size );
+        }
     }
 
     return 0;
 }
 
+// while loading a track against a cached set, its _lib resolves to an empty PSF
+static __thread const struct hq_rom_set * psf_lib_override;
+
+static const uint8_t psf_empty_lib[16] = { 'P', 'S', 'F', 0x41 };
+
+static __thread struct {
+    size_t pos;
+} psf_empty_lib_file;
+
 static void * psf_file_fopen( const char * uri )
 {
+    if ( psf_lib_override && !strcmp( uri, psf_lib_override->path ) ) {
+        psf_empty_lib_file.pos = 0;
+        return &psf_empty_lib_file;
+    }
     return deadbeef->fopen( uri );
 }
 
 static size_t psf_file_fread( void * buffer, size_t size, size_t count, void * handle )
 {
+    if ( handle == &psf_empty_lib_file ) {
+        size_t avail = sizeof( psf_empty_lib ) - psf_empty_lib_file.pos;
+        if ( !size ) return 0;
+        if ( count > avail / size ) count = avail / size;
+        memcpy( buffer, psf_empty_lib + psf_empty_lib_file.pos, count * size );
+        psf_empty_lib_file.pos += count * size;
+        return count;
+    }
     return deadbeef->fread( buffer, size, count, handle );
 }
 
 static int psf_file_fseek( void * handle, int64_t offset, int whence )
 {
+    if ( handle == &psf_empty_lib_file ) {
+        int64_t pos = offset;
+        if ( whence == SEEK_CUR ) pos += psf_empty_lib_file.pos;
+        else if ( whence == SEEK_END ) pos += sizeof( psf_empty_lib );
+        if ( pos < 0 || pos > (int64_t) sizeof( psf_empty_lib ) ) return -1;
+        psf_empty_lib_file.pos = pos;
+        return 0;
+    }
     return deadbeef->fseek( handle, offset, whence );
 }
 
 static int psf_file_fclose( void * handle )
 {
+    if ( handle == &psf_empty_lib_file ) return 0;
     deadbeef->fclose( handle );
     return 0;
 }
 
 static long psf_file_ftell( void * handle )
 {
+    if ( handle == &psf_empty_lib_file ) return psf_empty_lib_file.pos;
     return deadbeef->ftell( handle );
 }
 
@@ -352,298 +678,3389 @@ const psf_file_callbacks psf_file_system =
     psf_file_ftell
 };
 
-typedef struct {
-    DB_fileinfo_t info;
-    const char *path;
-    void *emu;
-    uint8_t *key;
-    uint32_t key_size;
-    uint8_t *z80;
-    uint32_t z80_size;
-    uint8_t *samples;
-    uint32_t samples_size;
-    int samples_played;
-    int samples_to_play;
-    int samples_to_fade;
-} hq_info_t;
+// background jobs run on a small pool of threads, started on first use. Whole-track
+// renders go on a queue of their own that is only served when no quick job waits, and
+// with more than one thread they never occupy all of them, so tag scans and preloads
+// are not stuck behind a library's worth of length detection
+typedef struct hq_job {
+    void (*run) (void *ctx);
+    void (*cancel) (void *ctx);
+    void *ctx;
+    struct hq_job *next;
+} hq_job_t;
 
-DB_fileinfo_t *
-hq_open (uint32_t hints) {
-    DB_fileinfo_t *_info = (DB_fileinfo_t *)malloc (sizeof (hq_info_t));
-    memset (_info, 0, sizeof (hq_info_t));
-    return _info;
+#define POOL_MAX_THREADS 64
+
+static uintptr_t pool_mutex;
+static uintptr_t pool_cond;
+static intptr_t pool_tids[ POOL_MAX_THREADS ];
+static int pool_threads;
+static int pool_quit;
+static hq_job_t *pool_head[ 2 ];
+static hq_job_t *pool_tail[ 2 ];
+static int pool_slow_running;
+
+// the queue to serve next, -1 if there is nothing this thread may take
+static int pool_pick( void )
+{
+    if ( pool_head[ 0 ] ) return 0;
+    if ( pool_head[ 1 ] && ( pool_threads < 2 || pool_slow_running < pool_threads - 1 ) ) return 1;
+    return -1;
 }
 
-int
-hq_init (DB_fileinfo_t *_info, DB_playItem_t *it) {
-    hq_info_t *info = (hq_info_t *)_info;
+static void pool_thread( void * ctx )
+{
+    (void) ctx;
+    for (;;) {
+        int slow;
+        deadbeef->mutex_lock( pool_mutex );
+        while ( !pool_quit && ( slow = pool_pick() ) < 0 ) {
+            deadbeef->cond_wait( pool_cond, pool_mutex );
+        }
+        if ( pool_quit ) {
+            deadbeef->mutex_unlock( pool_mutex );
+            break;
+        }
+        hq_job_t * job = pool_head[ slow ];
+        pool_head[ slow ] = job->next;
+        if ( !pool_head[ slow ] ) pool_tail[ slow ] = NULL;
+        pool_slow_running += slow;
+        deadbeef->mutex_unlock( pool_mutex );
 
-    deadbeef->pl_lock ();
-    const char * uri = info->path = strdup( deadbeef->pl_find_meta (it, ":URI") );
-    deadbeef->pl_unlock ();
-    int psf_version = psf_load( uri, &psf_file_system, 0, 0, 0, 0, 0 );
-    if (psf_version < 0) {
-        trace ("hq: failed to open %s\n", uri);
-        return -1;
+        job->run( job->ctx );
+        free( job );
+
+        if ( slow ) {
+            deadbeef->mutex_lock( pool_mutex );
+            pool_slow_running--;
+            deadbeef->cond_broadcast( pool_cond );
+            deadbeef->mutex_unlock( pool_mutex );
+        }
     }
+}
 
-    struct psf_load_state state;
-    memset( &state, 0, sizeof(state) );
+// long running jobs poll this so shutdown does not wait on them
+static int pool_stopping( void )
+{
+    return __atomic_load_n( &pool_quit, __ATOMIC_RELAXED );
+}
 
-    if ( psf_load( uri, &psf_file_system, psf_version, qsf_load, &state, psf_info_meta, &state ) <= 0 ) {
-        if ( state.key ) free( state.key );
-        if ( state.z80_rom ) free( state.z80_rom );
-        if ( state.sample_rom ) free( state.sample_rom );
-        trace( "hq: invalid PSF file\n" );
-        return -1;
-    }
+// run is handed ctx and owns it from then on; jobs still queued at shutdown get cancel instead
+static int pool_enqueue( void (*run) (void *ctx), void (*cancel) (void *ctx), void * ctx, int slow )
+{
+    hq_job_t * job = malloc( sizeof( hq_job_t ) );
+    if ( !job ) return -1;
+    job->run = run;
+    job->cancel = cancel;
+    job->ctx = ctx;
+    job->next = NULL;
 
-    info->emu = malloc( qsound_get_state_size() );
-    if ( !info->emu ) {
-        trace( "hq: out of memory\n" );
-        if ( state.key ) free( state.key );
-        if ( state.z80_rom ) free( state.z80_rom );
-        if ( state.sample_rom ) free( state.sample_rom );
+    deadbeef->mutex_lock( pool_mutex );
+    if ( !pool_threads ) {
+        int threads = deadbeef->conf_get_int( "hq.scan_threads", 0 );
+        if ( threads <= 0 ) threads = sysconf( _SC_NPROCESSORS_ONLN );
+        if ( threads <= 0 ) threads = 1;
+        if ( threads > POOL_MAX_THREADS ) threads = POOL_MAX_THREADS;
+        pool_quit = 0;
+        while ( pool_threads < threads ) {
+            pool_tids[ pool_threads ] = deadbeef->thread_start_low_priority( pool_thread, NULL );
+            if ( !pool_tids[ pool_threads ] ) break;
+            pool_threads++;
+        }
+    }
+    if ( !pool_threads ) {
+        deadbeef->mutex_unlock( pool_mutex );
+        free( job );
         return -1;
     }
+    if ( pool_tail[ slow ] ) pool_tail[ slow ]->next = job;
+    else pool_head[ slow ] = job;
+    pool_tail[ slow ] = job;
+    deadbeef->cond_broadcast( pool_cond );
+    deadbeef->mutex_unlock( pool_mutex );
+    return 0;
+}
 
-    info->key = state.key;
-    info->key_size = state.key_size;
-    info->z80 = state.z80_rom;
-    info->z80_size = state.z80_size;
-    info->samples = state.sample_rom;
-    info->samples_size = state.sample_size;
+static int pool_submit( void (*run) (void *ctx), void (*cancel) (void *ctx), void * ctx )
+{
+    return pool_enqueue( run, cancel, ctx, 0 );
+}
 
-    qsound_clear_state( info->emu );
+// for jobs that render whole tracks
+static int pool_submit_slow( void (*run) (void *ctx), void (*cancel) (void *ctx), void * ctx )
+{
+    return pool_enqueue( run, cancel, ctx, 1 );
+}
 
-    if(state.key_size == 11) {
-        uint8_t * ptr = state.key;
-        uint32_t swap_key1 = get_be32( ptr +  0 );
-        uint32_t swap_key2 = get_be32( ptr +  4 );
-        uint32_t addr_key  = get_be16( ptr +  8 );
-        uint8_t  xor_key   =        *( ptr + 10 );
-        qsound_set_kabuki_key( info->emu, swap_key1, swap_key2, addr_key, xor_key );
-    } else {
-        qsound_set_kabuki_key( info->emu, 0, 0, 0, 0 );
-    }
-    qsound_set_z80_rom( info->emu, state.z80_rom, state.z80_size );
-    qsound_set_sample_rom( info->emu, state.sample_rom, state.sample_size );
+static void pool_stop( void )
+{
+    deadbeef->mutex_lock( pool_mutex );
+    __atomic_store_n( &pool_quit, 1, __ATOMIC_RELAXED );
+    deadbeef->cond_broadcast( pool_cond );
+    deadbeef->mutex_unlock( pool_mutex );
 
-    int tag_song_ms = state.tag_song_ms;
-    int tag_fade_ms = state.tag_fade_ms;
+    while ( pool_threads ) {
+        deadbeef->thread_join( pool_tids[ --pool_threads ] );
+    }
 
-    if (!tag_song_ms)
-    {
-        tag_song_ms = ( 2 * 60 + 50 ) * 1000;
-        tag_fade_ms =            10   * 1000;
+    int slow;
+    for ( slow = 0; slow < 2; slow++ ) {
+        while ( pool_head[ slow ] ) {
+            hq_job_t * job = pool_head[ slow ];
+            pool_head[ slow ] = job->next;
+            if ( job->cancel ) job->cancel( job->ctx );
+            free( job );
+        }
+        pool_tail[ slow ] = NULL;
     }
+}
 
-    const int srate = 44100;
+#define ROM_CACHE_MAX_IDLE 2
 
-    info->samples_played = 0;
-    info->samples_to_play = (uint64_t)tag_song_ms * (uint64_t)srate / 1000;
-    info->samples_to_fade = (uint64_t)tag_fade_ms * (uint64_t)srate / 1000;
+#define EMU_POOL_SIZE 4
 
-    _info->plugin = &hq_plugin;
-    _info->fmt.channels = 2;
-    _info->fmt.bps = 16;
-    _info->fmt.samplerate = srate;
-    _info->fmt.channelmask = _info->fmt.channels == 1 ? DDB_SPEAKER_FRONT_LEFT : (DDB_SPEAKER_FRONT_LEFT | DDB_SPEAKER_FRONT_RIGHT);
-    _info->readpos = 0;
+// guards the ROM cache and the emulator pool
+static uintptr_t hq_mutex;
+static struct hq_rom_set * rom_cache;
 
-    return 0;
+static void * emu_pool[ EMU_POOL_SIZE ];
+static int emu_pool_count;
+
+static void * emu_alloc( void )
+{
+    void * emu = NULL;
+    deadbeef->mutex_lock( hq_mutex );
+    if ( emu_pool_count ) emu = emu_pool[ --emu_pool_count ];
+    deadbeef->mutex_unlock( hq_mutex );
+    if ( !emu ) emu = malloc( qsound_get_state_size() );
+    return emu;
 }
 
-void
-hq_free (DB_fileinfo_t *_info) {
-    hq_info_t *info = (hq_info_t *)_info;
-    if (info) {
-        if (info->samples) {
-            free (info->samples);
-            info->samples = NULL;
-        }
-        if (info->z80) {
-            free (info->z80);
-            info->z80 = NULL;
-        }
-        if (info->key) {
-            free (info->key);
-            info->key = NULL;
-        }
-        if (info->emu) {
-            free (info->emu);
-            info->emu = NULL;
-        }
-        if (info->path) {
-            free (info->path);
-            info->path = NULL;
-        }
-        free (info);
+static void emu_release( void * emu )
+{
+    deadbeef->mutex_lock( hq_mutex );
+    if ( emu_pool_count < EMU_POOL_SIZE ) {
+        emu_pool[ emu_pool_count++ ] = emu;
+        emu = NULL;
     }
+    deadbeef->mutex_unlock( hq_mutex );
+    if ( emu ) free( emu );
 }
 
-int
-hq_read (DB_fileinfo_t *_info, char *bytes, int size) {
-    hq_info_t *info = (hq_info_t *)_info;
-    short * samples = (short *) bytes;
-    uint32_t sample_count = size / ( 2 * sizeof(short) );
+// bring a cleared emulator to the state every playback starts from
+static void emu_setup( void * emu, uint8_t * key, uint32_t key_size, uint8_t * z80, uint32_t z80_size,
+                       uint8_t * samples, uint32_t samples_size )
+{
+    qsound_clear_state( emu );
 
-    if ( info->samples_played >= info->samples_to_play + info->samples_to_fade ) {
-        return -1;
+    if(key_size == 11) {
+        uint8_t * ptr = key;
+        uint32_t swap_key1 = get_be32( ptr +  0 );
+        uint32_t swap_key2 = get_be32( ptr +  4 );
+        uint32_t addr_key  = get_be16( ptr +  8 );
+        uint8_t  xor_key   =        *( ptr + 10 );
+        qsound_set_kabuki_key( emu, swap_key1, swap_key2, addr_key, xor_key );
+    } else {
+        qsound_set_kabuki_key( emu, 0, 0, 0, 0 );
     }
+    qsound_set_z80_rom( emu, z80, z80_size );
+    qsound_set_sample_rom( emu, samples, samples_size );
+}
 
-    if ( qsound_execute( info->emu, 0x7fffffff, samples, &sample_count ) < 0 ) {
-        trace ( "hq: execution error\n" );
-        return -1;
+static void rom_set_free( struct hq_rom_set * set )
+{
+    if ( set->bundle ) {
+        __atomic_sub_fetch( &rom_arena.mapped, set->bundle_size, __ATOMIC_RELAXED );
+        munmap( set->bundle, set->bundle_size );
     }
+    else {
+        rom_image_free( set->key );
+        rom_image_free( set->z80 );
+        rom_image_free( set->samples );
+    }
+    if ( set->emu_template ) free( set->emu_template );
+    free( set->path );
+    free( set );
+}
 
-    int samples_start = info->samples_played;
+// resolve a _lib tag the same way psflib does, relative to the referencing file
+static void rom_lib_path( char * out, const char * uri, const char * lib )
+{
+    const char * sep = NULL;
+    const char * p;
+    for ( p = uri; *p; p++ ) {
+        if ( strchr( psf_file_system.path_separators, *p ) ) sep = p;
+    }
+    size_t len = sep ? sep - uri + 1 : 0;
+    if ( len > PATH_MAX - 1 ) len = PATH_MAX - 1;
+    memcpy( out, uri, len );
+    strncpy( out + len, lib, PATH_MAX - 1 - len );
+    out[ PATH_MAX - 1 ] = 0;
+}
+
+// hq.rom_bundle keeps every ROM set assembled on disk under <config>/hq_rom, one file per
+// _lib named after a hash of its path. Loading the set again maps the file read-only and
+// hands the emulator pointers into it, so nothing is inflated or copied and processes
+// playing the same set share its pages. A bundle only stands in for a _lib of the size
+// and mtime it was made from; files are replaced by rename, never rewritten in place
+#define ROM_BUNDLE_MAGIC "HQRB"
+#define ROM_BUNDLE_VERSION 1
+#define ROM_BUNDLE_ALIGN 4096
+
+struct rom_bundle_header
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t hash;              // of the images, checked each time the bundle is mapped
+    uint64_t source_size;
+    int64_t source_mtime;
+    uint32_t path_size;         // the _lib path follows the header, then the key image
+    uint32_t key_size;
+    uint32_t z80_size;
+    uint32_t samples_size;
+    uint64_t z80_offset;
+    uint64_t samples_offset;
+};
+
+static void rom_bundle_path( char * out, size_t size, const char * path, const char * suffix )
+{
+    uint64_t h = hash_data( HASH_SEED, path, strlen( path ) );
+    snprintf( out, size, "%s/hq_rom/%016llx.rom%s", deadbeef->get_config_dir(), (unsigned long long) h, suffix );
+}
+
+// identifies a set's contents for bundles and the PCM cache
+static uint64_t rom_set_hash( const struct hq_rom_set * set )
+{
+    uint32_t sizes[3] = { set->key_size, set->z80_size, set->samples_size };
+    uint64_t h = hash_data( HASH_SEED, sizes, sizeof( sizes ) );
+    h = hash_data( h, set->key, set->key_size );
+    h = hash_data( h, set->z80, set->z80_size );
+    return hash_data( h, set->samples, set->samples_size );
+}
+
+// the images never change once the set is cached, so their hash is taken only once
+static uint64_t rom_set_digest( struct hq_rom_set * set )
+{
+    if ( !__atomic_load_n( &set->hashed, __ATOMIC_ACQUIRE ) ) {
+        // racing callers compute the same value
+        uint64_t h = rom_set_hash( set );
+        __atomic_store_n( &set->hash, h, __ATOMIC_RELAXED );
+        __atomic_store_n( &set->hashed, 1, __ATOMIC_RELEASE );
+        return h;
+    }
+    return __atomic_load_n( &set->hash, __ATOMIC_RELAXED );
+}
+
+static int rom_bundle_span( uint64_t offset, uint32_t length, uint64_t size )
+{
+    return !length || ( offset <= size && length <= size - offset );
+}
+
+// point the set's images into its bundle, if there is a current one
+static int rom_bundle_map( struct hq_rom_set * set )
+{
+    char bundle_path[PATH_MAX];
+    rom_bundle_path( bundle_path, sizeof( bundle_path ), set->path, "" );
+
+    int fd = open( bundle_path, O_RDONLY );
+    if ( fd < 0 ) return -1;
+
+    struct stat st;
+    if ( fstat( fd, &st ) < 0 || st.st_size < (off_t) sizeof( struct rom_bundle_header ) ) {
+        close( fd );
+        return -1;
+    }
+    uint8_t * map = mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+    close( fd );
+    if ( map == MAP_FAILED ) return -1;
+
+    struct rom_bundle_header header;
+    memcpy( &header, map, sizeof( header ) );
+    uint32_t path_size = strlen( set->path );
+    uint64_t size = st.st_size;
+    if ( memcmp( header.magic, ROM_BUNDLE_MAGIC, 4 ) || header.version != ROM_BUNDLE_VERSION ||
+         header.source_size != (uint64_t) set->size || header.source_mtime != (int64_t) set->mtime ||
+         header.path_size != path_size || !rom_bundle_span( sizeof( header ), path_size + header.key_size, size ) ||
+         memcmp( map + sizeof( header ), set->path, path_size ) ||
+         !rom_bundle_span( header.z80_offset, header.z80_size, size ) ||
+         !rom_bundle_span( header.samples_offset, header.samples_size, size ) ) {
+        munmap( map, st.st_size );
+        return -1;
+    }
+
+    set->key = header.key_size ? map + sizeof( header ) + path_size : NULL;
+    set->key_size = header.key_size;
+    set->z80 = header.z80_size ? map + header.z80_offset : NULL;
+    set->z80_size = header.z80_size;
+    set->samples = header.samples_size ? map + header.samples_offset : NULL;
+    set->samples_size = header.samples_size;
+
+    // reading it through once costs far less than inflating the _lib, and a bundle
+    // damaged in place is caught before anything plays from it
+    if ( rom_set_hash( set ) != header.hash ) {
+        munmap( map, st.st_size );
+        set->key = set->z80 = set->samples = NULL;
+        set->key_size = set->z80_size = set->samples_size = 0;
+        return -1;
+    }
+
+    set->hash = header.hash;
+    set->hashed = 1;
+    madvise( map, st.st_size, MADV_RANDOM );
+    set->bundle = map;
+    set->bundle_size = st.st_size;
+    __atomic_add_fetch( &rom_arena.mapped, set->bundle_size, __ATOMIC_RELAXED );
+    return 0;
+}
+
+// whether the bundle on disk already holds this set, e.g. written by another thread or
+// process that missed the cache at the same time
+static int rom_bundle_current( struct hq_rom_set * set, const char * bundle_path )
+{
+    FILE * f = fopen( bundle_path, "rb" );
+    if ( !f ) return 0;
+    struct rom_bundle_header header;
+    int ok = fread( &header, sizeof( header ), 1, f ) == 1;
+    fclose( f );
+    return ok && !memcmp( header.magic, ROM_BUNDLE_MAGIC, 4 ) && header.version == ROM_BUNDLE_VERSION &&
+           header.source_size == (uint64_t) set->size && header.source_mtime == (int64_t) set->mtime &&
+           header.hash == rom_set_digest( set );
+}
+
+// the images go at page boundaries, so the mapping can be advised per image later on
+static void rom_bundle_write( struct hq_rom_set * set )
+{
+    char dir_path[PATH_MAX], part[PATH_MAX], bundle_path[PATH_MAX];
+    snprintf( dir_path, sizeof( dir_path ), "%s/hq_rom", deadbeef->get_config_dir() );
+    mkdir( dir_path, 0755 );
+    rom_bundle_path( bundle_path, sizeof( bundle_path ), set->path, "" );
+    if ( rom_bundle_current( set, bundle_path ) ) return;
+    // other threads and processes may be writing the same bundle, each into its own file
+    rom_bundle_path( part, sizeof( part ), set->path, ".XXXXXX" );
+
+    struct rom_bundle_header header;
+    memset( &header, 0, sizeof( header ) );
+    memcpy( header.magic, ROM_BUNDLE_MAGIC, 4 );
+    header.version = ROM_BUNDLE_VERSION;
+    header.source_size = set->size;
+    header.source_mtime = set->mtime;
+    header.path_size = strlen( set->path );
+    header.key_size = set->key_size;
+    header.z80_size = set->z80_size;
+    header.samples_size = set->samples_size;
+    header.z80_offset = ( sizeof( header ) + header.path_size + header.key_size + ROM_BUNDLE_ALIGN - 1 ) & ~(uint64_t)( ROM_BUNDLE_ALIGN - 1 );
+    header.samples_offset = ( header.z80_offset + header.z80_size + ROM_BUNDLE_ALIGN - 1 ) & ~(uint64_t)( ROM_BUNDLE_ALIGN - 1 );
+
+    header.hash = rom_set_digest( set );
+
+    int fd = mkstemp( part );
+    if ( fd < 0 ) return;
+    fchmod( fd, 0644 );
+    FILE * f = fdopen( fd, "wb" );
+    if ( !f ) {
+        close( fd );
+        unlink( part );
+        return;
+    }
+    int ok = fwrite( &header, sizeof( header ), 1, f ) == 1 &&
+             fwrite( set->path, 1, header.path_size, f ) == header.path_size &&
+             fwrite( set->key, 1, set->key_size, f ) == set->key_size &&
+             fseeko( f, header.z80_offset, SEEK_SET ) == 0 &&
+             fwrite( set->z80, 1, set->z80_size, f ) == set->z80_size &&
+             fseeko( f, header.samples_offset, SEEK_SET ) == 0 &&
+             fwrite( set->samples, 1, set->samples_size, f ) == set->samples_size;
+    ok = fclose( f ) == 0 && ok;
+    if ( !ok || rename( part, bundle_path ) < 0 ) {
+        unlink( part );
+    }
+}
+
+static struct hq_rom_set * rom_set_acquire( const char * path )
+{
+    struct stat st;
+    if ( stat( path, &st ) < 0 ) return NULL;
+
+    struct hq_rom_set * set, ** prev;
+
+    deadbeef->mutex_lock( hq_mutex );
+    for ( prev = &rom_cache; ( set = *prev ); prev = &set->next ) {
+        if ( !strcmp( set->path, path ) ) {
+            *prev = set->next;
+            if ( set->mtime == st.st_mtime && set->size == st.st_size ) {
+                // most recently used sets stay at the head
+                set->refcount++;
+                set->next = rom_cache;
+                rom_cache = set;
+                deadbeef->mutex_unlock( hq_mutex );
+                return set;
+            }
+            // stale, drop it from the cache and let its users release it
+            if ( !set->refcount ) rom_set_free( set );
+            else set->next = NULL;
+            break;
+        }
+    }
+    deadbeef->mutex_unlock( hq_mutex );
+
+    set = calloc( 1, sizeof( struct hq_rom_set ) );
+    if ( !set || !( set->path = strdup( path ) ) ) {
+        if ( set ) free( set );
+        return NULL;
+    }
+    set->mtime = st.st_mtime;
+    set->size = st.st_size;
+    set->refcount = 1;
+
+    int bundle = deadbeef->conf_get_int( "hq.rom_bundle", 0 );
+    if ( !bundle || rom_bundle_map( set ) < 0 ) {
+        struct psf_load_state state;
+        memset( &state, 0, sizeof(state) );
+
+        long faults = rom_faults_now();
+        int err = psf_load( path, &psf_file_system, 0x41, qsf_load, &state, 0, 0 ) <= 0;
+        __atomic_add_fetch( &rom_arena.faults, rom_faults_now() - faults, __ATOMIC_RELAXED );
+        if ( err ) {
+            rom_image_free( state.key );
+            rom_image_free( state.z80_rom );
+            rom_image_free( state.sample_rom );
+            free( set->path );
+            free( set );
+            return NULL;
+        }
+
+        rom_image_settle( state.z80_rom, 0, 1 );
+        rom_image_settle( state.sample_rom, 1, 1 );
+        set->key = state.key;
+        set->key_size = state.key_size;
+        set->z80 = state.z80_rom;
+        set->z80_size = state.z80_size;
+        set->samples = state.sample_rom;
+        set->samples_size = state.sample_size;
+
+        if ( bundle ) rom_bundle_write( set );
+    }
+
+    deadbeef->mutex_lock( hq_mutex );
+    struct hq_rom_set * other;
+    for ( other = rom_cache; other; other = other->next ) {
+        if ( !strcmp( other->path, path ) && other->mtime == set->mtime && other->size == set->size ) {
+            // somebody else loaded it meanwhile
+            other->refcount++;
+            deadbeef->mutex_unlock( hq_mutex );
+            rom_set_free( set );
+            return other;
+        }
+    }
+    set->next = rom_cache;
+    rom_cache = set;
+    deadbeef->mutex_unlock( hq_mutex );
+
+    return set;
+}
+
+static void rom_set_release( struct hq_rom_set * set )
+{
+    deadbeef->mutex_lock( hq_mutex );
+
+    if ( --set->refcount ) {
+        deadbeef->mutex_unlock( hq_mutex );
+        return;
+    }
+
+    struct hq_rom_set * it, ** prev;
+    int idle = 0;
+    int cached = 0;
+    for ( prev = &rom_cache; ( it = *prev ); ) {
+        if ( it == set ) cached = 1;
+        if ( !it->refcount && ++idle > ROM_CACHE_MAX_IDLE ) {
+            *prev = it->next;
+            rom_set_free( it );
+            continue;
+        }
+        prev = &it->next;
+    }
+    if ( !cached ) {
+        // it went stale while in use
+        rom_set_free( set );
+    }
+
+    deadbeef->mutex_unlock( hq_mutex );
+}
+
+// post-setup emulator state for tracks that use the set's images unmodified
+static const void * rom_set_template( struct hq_rom_set * set )
+{
+    deadbeef->mutex_lock( hq_mutex );
+    if ( !set->emu_template ) {
+        set->emu_template = malloc( qsound_get_state_size() );
+        if ( set->emu_template ) {
+            emu_setup( set->emu_template, set->key, set->key_size, set->z80, set->z80_size,
+                       set->samples, set->samples_size );
+        }
+    }
+    deadbeef->mutex_unlock( hq_mutex );
+    return set->emu_template;
+}
+
+static void rom_cache_flush( void )
+{
+    struct hq_rom_set * it, ** prev;
+
+    deadbeef->mutex_lock( hq_mutex );
+    for ( prev = &rom_cache; ( it = *prev ); ) {
+        if ( !it->refcount ) {
+            *prev = it->next;
+            rom_set_free( it );
+            continue;
+        }
+        prev = &it->next;
+    }
+    while ( emu_pool_count ) {
+        free( emu_pool[ --emu_pool_count ] );
+    }
+    deadbeef->mutex_unlock( hq_mutex );
+}
+
+// polyphase resampler from the core rate to the output rate. Each output frame
+// is a RS_TAPS point windowed sinc over the core frames around it, with the
+// coefficients interpolated between RS_PHASES precomputed phases
+#define RS_TAPS 32
+#define RS_PHASES 256
+
+typedef float rs_v4sf __attribute__ ((vector_size (16)));
+typedef float rs_v4sf_u __attribute__ ((vector_size (16), aligned (4)));
+
+typedef struct {
+    int rate_in;
+    int rate_out;
+    // RS_PHASES + 1 phases of RS_TAPS coefficients, each stored twice to line up with stereo frames
+    float *filter;
+    // interleaved stereo core frames, the first one being core frame history_pos
+    float *history;
+    int64_t history_pos;
+    int history_count;
+    int history_max;
+    // core frame from which the history is silent through to its end
+    int64_t silent_from;
+    // output of the last call, before gain and format conversion; frames from out_sound
+    // on are silent and not written
+    float *out;
+    int out_max;
+    int out_sound;
+} hq_resampler_t;
+
+// the resampler and output stage loops, picked at startup from what the CPU supports;
+// hq.simd=0 keeps the portable ones. Output kernels give the same result either way, the
+// AVX2 resampler sums its taps in a different order
+static struct {
+    int (*rs_run) (hq_resampler_t *rs, int64_t core, int frac, int count);
+    void (*output_s16) (short *samples, int frames, float level, float slope, int ramp);
+    void (*output_float) (float * restrict out, const short * restrict in, int frames, float level, float slope, int ramp);
+    void (*output_rs_s16) (short * restrict out, const float * restrict in, int frames, float level, float slope, int ramp);
+    void (*output_rs_float) (float * restrict out, const float * restrict in, int frames, float level, float slope, int ramp);
+    const char *name;
+} hq_kernels;
+
+static double rs_bessel_i0 (double x) {
+    double sum = 1, term = 1;
+    for (int k = 1; k < 32; k++) {
+        term *= ( x / ( 2 * k ) ) * ( x / ( 2 * k ) );
+        sum += term;
+    }
+    return sum;
+}
+
+static hq_resampler_t * rs_create (int rate_in, int rate_out) {
+    hq_resampler_t *rs = calloc( 1, sizeof( hq_resampler_t ) );
+    if ( !rs ) return NULL;
+    rs->rate_in = rate_in;
+    rs->rate_out = rate_out;
+
+    // the history starts with enough room for the silence before the track
+    rs->history_max = RS_TAPS;
+    rs->history = malloc( rs->history_max * 2 * sizeof(float) );
+    if ( !rs->history || posix_memalign( (void **) &rs->filter, 32, ( RS_PHASES + 1 ) * RS_TAPS * 2 * sizeof(float) ) ) {
+        free( rs->history );
+        free( rs );
+        return NULL;
+    }
+
+    // cut off a little below the lower of the two Nyquist frequencies, Kaiser window
+    const double beta = 7.0;
+    double cutoff = 0.91 * ( rate_out < rate_in ? (double)rate_out / rate_in : 1.0 );
+    for (int p = 0; p <= RS_PHASES; p++) {
+        double frac = (double)p / RS_PHASES;
+        double h[RS_TAPS], sum = 0;
+        for (int k = 0; k < RS_TAPS; k++) {
+            double d = k - RS_TAPS / 2 + 1 - frac;
+            double x = d / ( RS_TAPS / 2 );
+            double w = fabs( x ) < 1 ? rs_bessel_i0( beta * sqrt( 1 - x * x ) ) / rs_bessel_i0( beta ) : 0;
+            double a = M_PI * cutoff * d;
+            h[k] = w * ( d == 0 ? 1 : sin( a ) / a );
+            sum += h[k];
+        }
+        for (int k = 0; k < RS_TAPS; k++) {
+            rs->filter[ ( p * RS_TAPS + k ) * 2 + 0 ] = h[k] / sum;
+            rs->filter[ ( p * RS_TAPS + k ) * 2 + 1 ] = h[k] / sum;
+        }
+    }
+    return rs;
+}
+
+static void rs_free (hq_resampler_t *rs) {
+    free( rs->filter );
+    free( rs->history );
+    free( rs->out );
+    free( rs );
+}
+
+// core frame that output frame n falls on, and how far past it
+static int64_t rs_core_frame (const hq_resampler_t *rs, int64_t n, int *frac) {
+    int64_t t = n * rs->rate_in;
+    if ( frac ) *frac = t % rs->rate_out;
+    return t / rs->rate_out;
+}
+
+// start over at output frame n, returns the first core frame the emulator has to produce;
+// frames before the start of the track are silence
+static int64_t rs_reset (hq_resampler_t *rs, int64_t n) {
+    rs->history_pos = rs_core_frame( rs, n, NULL ) - RS_TAPS / 2 + 1;
+    rs->history_count = 0;
+    rs->silent_from = rs->history_pos;
+    if ( rs->history_pos < 0 ) {
+        rs->history_count = -rs->history_pos;
+        memset( rs->history, 0, rs->history_count * 2 * sizeof(float) );
+        return 0;
+    }
+    return rs->history_pos;
+}
+
+// core frames needed to produce output frames up to n, exclusive
+static int64_t rs_core_needed (const hq_resampler_t *rs, int64_t n) {
+    return rs_core_frame( rs, n - 1, NULL ) + RS_TAPS / 2 + 1;
+}
+
+// room for count more core frames, dropping the ones output frame n no longer needs
+static int rs_reserve (hq_resampler_t *rs, int64_t n, int count) {
+    int64_t keep = rs_core_frame( rs, n, NULL ) - RS_TAPS / 2 + 1;
+    int drop = keep - rs->history_pos;
+    if ( drop > rs->history_count ) drop = rs->history_count;
+    if ( drop > 0 ) {
+        memmove( rs->history, rs->history + drop * 2, ( rs->history_count - drop ) * 2 * sizeof(float) );
+        rs->history_pos += drop;
+        rs->history_count -= drop;
+    }
+    if ( rs->history_count + count > rs->history_max ) {
+        float *history = realloc( rs->history, ( rs->history_count + count ) * 2 * sizeof(float) );
+        if ( !history ) return -1;
+        rs->history = history;
+        rs->history_max = rs->history_count + count;
+    }
+    return 0;
+}
+
+static void rs_append (hq_resampler_t *rs, const short *samples, int count) {
+    float *dst = rs->history + rs->history_count * 2;
+    for (int i = 0; i < count * 2; i++) {
+        dst[i] = samples[i];
+    }
+    rs->history_count += count;
+
+    int sound = count;
+    while ( sound > 0 && !( samples[ sound * 2 - 1 ] | samples[ sound * 2 - 2 ] ) ) sound--;
+    if ( sound ) rs->silent_from = rs->history_pos + rs->history_count - count + sound;
+}
+
+// filter count output frames into rs->out, the first at core frame core and frac / rate_out
+// past it; stops where the rest would be filtered silence and returns the frames written
+static int rs_run (hq_resampler_t *rs, int64_t core, int frac, int count) {
+    const int step = rs->rate_in / rs->rate_out;
+    const int step_frac = rs->rate_in % rs->rate_out;
+    const float phase_scale = (float)RS_PHASES / rs->rate_out;
+
+    for (int i = 0; i < count; i++) {
+        if ( core - RS_TAPS / 2 + 1 >= rs->silent_from ) {
+            return i;
+        }
+        float phase = frac * phase_scale;
+        int p = (int)phase;
+        rs_v4sf mix = { phase - p, phase - p, phase - p, phase - p };
+
+        const rs_v4sf *a = (const rs_v4sf *)( rs->filter + p * RS_TAPS * 2 );
+        const rs_v4sf *b = a + RS_TAPS / 2;
+        const float *x = rs->history + ( core - RS_TAPS / 2 + 1 - rs->history_pos ) * 2;
+
+        rs_v4sf acc = { 0, 0, 0, 0 };
+        for (int k = 0; k < RS_TAPS / 2; k++) {
+            rs_v4sf c = a[k] + ( b[k] - a[k] ) * mix;
+            acc += c * *(const rs_v4sf_u *)( x + k * 4 );
+        }
+        rs->out[i * 2 + 0] = acc[0] + acc[2];
+        rs->out[i * 2 + 1] = acc[1] + acc[3];
+
+        core += step;
+        frac += step_frac;
+        if ( frac >= rs->rate_out ) {
+            frac -= rs->rate_out;
+            core++;
+        }
+    }
+    return count;
+}
+
+#ifdef HQ_X86
+// four taps of both channels per step, halves folded together at the end
+__attribute__ ((target ("avx2")))
+static int rs_run_avx2 (hq_resampler_t *rs, int64_t core, int frac, int count) {
+    const int step = rs->rate_in / rs->rate_out;
+    const int step_frac = rs->rate_in % rs->rate_out;
+    const float phase_scale = (float)RS_PHASES / rs->rate_out;
+
+    for (int i = 0; i < count; i++) {
+        if ( core - RS_TAPS / 2 + 1 >= rs->silent_from ) {
+            return i;
+        }
+        float phase = frac * phase_scale;
+        int p = (int)phase;
+        __m256 mix = _mm256_set1_ps( phase - p );
+
+        const float *a = rs->filter + p * RS_TAPS * 2;
+        const float *b = a + RS_TAPS * 2;
+        const float *x = rs->history + ( core - RS_TAPS / 2 + 1 - rs->history_pos ) * 2;
+
+        __m256 acc = _mm256_setzero_ps();
+        for (int k = 0; k < RS_TAPS * 2; k += 8) {
+            __m256 ak = _mm256_load_ps( a + k );
+            __m256 c = _mm256_add_ps( ak, _mm256_mul_ps( _mm256_sub_ps( _mm256_load_ps( b + k ), ak ), mix ) );
+            acc = _mm256_add_ps( acc, _mm256_mul_ps( c, _mm256_loadu_ps( x + k ) ) );
+        }
+        __m128 half = _mm_add_ps( _mm256_castps256_ps128( acc ), _mm256_extractf128_ps( acc, 1 ) );
+        half = _mm_add_ps( half, _mm_movehl_ps( half, half ) );
+        _mm_storel_pi( (__m64 *)( rs->out + i * 2 ), half );
+
+        core += step;
+        frac += step_frac;
+        if ( frac >= rs->rate_out ) {
+            frac -= rs->rate_out;
+            core++;
+        }
+    }
+    return count;
+}
+#endif
+
+// produce output frames n to n + count into rs->out, the history has to cover them
+static int rs_process (hq_resampler_t *rs, int64_t n, int count) {
+    if ( count > rs->out_max ) {
+        float *out = realloc( rs->out, count * 2 * sizeof(float) );
+        if ( !out ) return -1;
+        rs->out = out;
+        rs->out_max = count;
+    }
+
+    int frac;
+    int64_t core = rs_core_frame( rs, n, &frac );
+    rs->out_sound = hq_kernels.rs_run( rs, core, frac, count );
+    return 0;
+}
+
+typedef struct {
+    int position;
+    void *state;
+} hq_snapshot_t;
+
+typedef struct {
+    DB_fileinfo_t info;
+    const char *path;
+    void *emu;
+    const void *emu_template;
+    void *emu_template_owned;
+    struct hq_rom_set *rom;
+    uint8_t *key;
+    uint32_t key_size;
+    uint8_t *z80;
+    uint32_t z80_size;
+    uint8_t *samples;
+    uint32_t samples_size;
+    int samples_played;
+    int samples_to_play;
+    int samples_to_fade;
+    // song and fade together, as the tags or length detection gave them
+    int length_ms;
+    // core frames the emulator renders, past the end of the fade when resampling
+    int emu_length;
+    int emu_position;
+    hq_snapshot_t *snapshots;
+    int snapshot_count;
+    int snapshot_max;
+    int snapshot_interval;
+    // render-ahead worker, filling a single producer/single consumer ring
+    intptr_t ahead_tid;
+    uintptr_t ahead_mutex;
+    uintptr_t ahead_cond;
+    int ahead_quit;
+    int ahead_done;
+    short *ring;
+    unsigned ring_frames;
+    unsigned ring_read;
+    unsigned ring_write;
+    // output stage: fixed gain, and 16-bit source for float output
+    float gain;
+    int output_float;
+    short *scratch;
+    int scratch_frames;
+    // set when the output rate differs from the core rate
+    hq_resampler_t *rs;
+    // the emulator renders whole blocks, reads are served from here
+    short *block;
+    int block_frames;
+    int block_pos;
+    int block_fill;
+    // rendered core output from the PCM cache, replacing the emulator when present
+    void *pcm_map;
+    size_t pcm_map_size;
+    const short *pcm;
+    int pcm_frames;
+    int pcm_pos;
+    uint64_t pcm_key;
+    uint64_t patch_hash;        // of the track's own sections over its ROM set
+    // hq.preload: the item being played, and the output frame at which to warm the next one
+    DB_playItem_t *it;
+    int preload_at;
+#ifdef HQ_STATS
+    hq_stats_t stats;
+    // hq.stats_log seconds between log lines, in output frames
+    uint64_t stats_log_frames;
+    uint64_t stats_next_log;
+#endif
+} hq_info_t;
+
+#ifdef HQ_STATS
+static uint64_t hq_stats_now (void) {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void hq_stats_read (hq_info_t *info, uint64_t ns, int frames) {
+    hq_stats_t * st = &info->stats;
+    int bucket = 0;
+    uint64_t us = ns / 1000;
+    while ( us >= 2 && bucket < HQ_STATS_READ_BUCKETS - 1 ) {
+        us >>= 1;
+        bucket++;
+    }
+    st->reads++;
+    st->read_ns += ns;
+    if ( ns > st->read_max_ns ) st->read_max_ns = ns;
+    st->read_hist[ bucket ]++;
+    if ( frames > 0 ) st->frames_output += frames;
+}
+
+// one key=value line per report, so logs can be grepped and parsed
+static void hq_stats_log (hq_info_t *info, const char *event) {
+    hq_stats_t st;
+    char hist[ HQ_STATS_READ_BUCKETS * 21 ];
+    int i, len = 0;
+    hq_get_stats( &info->info, &st );
+    for ( i = 0; i < HQ_STATS_READ_BUCKETS; i++ ) {
+        len += snprintf( hist + len, sizeof(hist) - len, "%s%llu", i ? "," : "", (unsigned long long) st.read_hist[ i ] );
+    }
+    fprintf( stderr, "hq_stats event=%s uri=\"%s\" load_ms=%.3f reads=%llu read_avg_us=%.1f read_max_us=%.1f "
+             "read_hist_us_log2=%s frames_output=%llu frames_silent=%llu frames_rendered=%llu frames_skipped=%llu seeks=%llu "
+             "seek_ms=%.3f seek_resets=%llu realtime=%.2f\n",
+             event, info->path ? info->path : "", st.load_ns / 1e6, (unsigned long long) st.reads,
+             st.reads ? st.read_ns / 1e3 / st.reads : 0., st.read_max_ns / 1e3, hist,
+             (unsigned long long) st.frames_output, (unsigned long long) st.frames_silent, (unsigned long long) st.frames_rendered,
+             (unsigned long long) st.frames_skipped, (unsigned long long) st.seeks, st.seek_ns / 1e6,
+             (unsigned long long) st.seek_resets, st.realtime );
+}
+#endif
+
+int
+hq_get_stats (DB_fileinfo_t *_info, hq_stats_t *stats) {
+#ifdef HQ_STATS
+    hq_info_t *info = (hq_info_t *)_info;
+    *stats = info->stats;
+    stats->frames_rendered = __atomic_load_n( &info->stats.frames_rendered, __ATOMIC_RELAXED );
+    uint64_t busy = stats->read_ns + stats->seek_ns;
+    stats->realtime = busy && _info->fmt.samplerate ? stats->frames_output * 1e9 / _info->fmt.samplerate / busy : 0.;
+    return 0;
+#else
+    (void) _info;
+    (void) stats;
+    return -1;
+#endif
+}
+
+// keep emulator states at regular positions, so seeking never has to start over from 0
+static void hq_snapshot_take (hq_info_t *info) {
+    int next = info->snapshot_interval;
+    if ( info->snapshot_count ) next += info->snapshots[ info->snapshot_count - 1 ].position;
+    if ( info->emu_position < next ) return;
+
+    if ( info->snapshot_count == info->snapshot_max ) {
+        // full, thin out to every other snapshot at twice the spacing
+        int i, j;
+        for ( i = 0, j = 1; j < info->snapshot_count; i++, j += 2 ) {
+            hq_snapshot_t tmp = info->snapshots[ i ];
+            info->snapshots[ i ] = info->snapshots[ j ];
+            info->snapshots[ j ] = tmp;
+        }
+        info->snapshot_count = i;
+        info->snapshot_interval *= 2;
+        return;
+    }
+
+    hq_snapshot_t * snap = &info->snapshots[ info->snapshot_count ];
+    if ( !snap->state ) {
+        snap->state = malloc( qsound_get_state_size() );
+        if ( !snap->state ) {
+            info->snapshot_max = info->snapshot_count;
+            return;
+        }
+    }
+    memcpy( snap->state, info->emu, qsound_get_state_size() );
+    snap->position = info->emu_position;
+    info->snapshot_count++;
+}
+
+// largest span handed to the core in one go while skipping
+#define SKIP_CHUNK 32768
+
+static int hq_render (hq_info_t *info, short *samples, uint32_t *sample_count) {
+    if ( qsound_execute( info->emu, 0x7fffffff, samples, sample_count ) < 0 ) {
+        trace ( "hq: execution error\n" );
+        return -1;
+    }
+
+    info->emu_position += *sample_count;
+    HQ_STAT( __atomic_add_fetch( &info->stats.frames_rendered, *sample_count, __ATOMIC_RELAXED ); )
+
+    if ( info->snapshot_max ) {
+        hq_snapshot_take( info );
+    }
+    return 0;
+}
+
+// advance the emulator without producing any output, for seeking
+static int hq_skip (hq_info_t *info, int count) {
+    while ( count > 0 ) {
+        if ( info->emu_position >= info->emu_length ) {
+            return -1;
+        }
+
+        uint32_t sample_count = min( count, SKIP_CHUNK );
+        if ( info->snapshot_max ) {
+            // stop at the next snapshot position so they stay evenly spaced
+            int next = info->snapshot_interval - info->emu_position;
+            if ( info->snapshot_count ) next += info->snapshots[ info->snapshot_count - 1 ].position;
+            if ( next > 0 && (uint32_t) next < sample_count ) sample_count = next;
+        }
+
+        if ( hq_render( info, NULL, &sample_count ) < 0 ) {
+            return -1;
+        }
+        HQ_STAT( info->stats.frames_skipped += sample_count; )
+
+        count -= sample_count;
+    }
+    return 0;
+}
+
+static void hq_ahead_thread (void *ctx) {
+    hq_info_t *info = (hq_info_t *)ctx;
+    int samples_length = info->emu_length;
+
+    for (;;) {
+        unsigned read = __atomic_load_n( &info->ring_read, __ATOMIC_ACQUIRE );
+        unsigned write = info->ring_write;
+        unsigned space = info->ring_frames - ( write - read );
+
+        // ahead_done is only changed with ahead_mutex held, the reader waits on it
+        deadbeef->mutex_lock( info->ahead_mutex );
+        if ( info->emu_position >= samples_length ) {
+            info->ahead_done = 1;
+        }
+        if ( info->ahead_quit || info->ahead_done ) {
+            deadbeef->cond_broadcast( info->ahead_cond );
+            deadbeef->mutex_unlock( info->ahead_mutex );
+            break;
+        }
+        if ( space < info->ring_frames / 4 ) {
+            // wait for the reader to drain a quarter of the ring
+            deadbeef->cond_wait( info->ahead_cond, info->ahead_mutex );
+            deadbeef->mutex_unlock( info->ahead_mutex );
+            continue;
+        }
+        deadbeef->mutex_unlock( info->ahead_mutex );
+
+        // fill up to the end of the ring, the next pass takes the wrapped part
+        unsigned offset = write & ( info->ring_frames - 1 );
+        uint32_t sample_count = min( space, info->ring_frames - offset );
+        if ( hq_render( info, info->ring + offset * 2, &sample_count ) < 0 ) {
+            deadbeef->mutex_lock( info->ahead_mutex );
+            info->ahead_done = 1;
+            deadbeef->mutex_unlock( info->ahead_mutex );
+            continue;
+        }
+
+        __atomic_store_n( &info->ring_write, write + sample_count, __ATOMIC_RELEASE );
+
+        deadbeef->mutex_lock( info->ahead_mutex );
+        deadbeef->cond_broadcast( info->ahead_cond );
+        deadbeef->mutex_unlock( info->ahead_mutex );
+    }
+}
+
+static void hq_ahead_start (hq_info_t *info) {
+    info->ahead_quit = 0;
+    info->ahead_done = 0;
+    info->ring_read = info->ring_write = 0;
+    info->ahead_tid = deadbeef->thread_start( hq_ahead_thread, info );
+}
+
+static void hq_ahead_stop (hq_info_t *info) {
+    deadbeef->mutex_lock( info->ahead_mutex );
+    info->ahead_quit = 1;
+    deadbeef->cond_broadcast( info->ahead_cond );
+    deadbeef->mutex_unlock( info->ahead_mutex );
+    deadbeef->thread_join( info->ahead_tid );
+    info->ahead_tid = 0;
+}
+
+// take up to count frames from the ring, waiting for the worker if it is empty
+static int hq_ahead_read (hq_info_t *info, short *samples, uint32_t count) {
+    unsigned read = info->ring_read;
+    unsigned write = __atomic_load_n( &info->ring_write, __ATOMIC_ACQUIRE );
+
+    if ( write == read ) {
+        deadbeef->mutex_lock( info->ahead_mutex );
+        while ( ( write = __atomic_load_n( &info->ring_write, __ATOMIC_ACQUIRE ) ) == read && !info->ahead_done ) {
+            deadbeef->cond_wait( info->ahead_cond, info->ahead_mutex );
+        }
+        deadbeef->mutex_unlock( info->ahead_mutex );
+        if ( write == read ) {
+            return -1;
+        }
+    }
+
+    if ( count > write - read ) count = write - read;
+
+    if ( samples ) {
+        unsigned offset = read & ( info->ring_frames - 1 );
+        unsigned first = min( count, info->ring_frames - offset );
+        memcpy( samples, info->ring + offset * 2, first * 2 * sizeof(short) );
+        memcpy( samples + first * 2, info->ring, ( count - first ) * 2 * sizeof(short) );
+    }
+
+    __atomic_store_n( &info->ring_read, read + count, __ATOMIC_RELEASE );
+
+    deadbeef->mutex_lock( info->ahead_mutex );
+    deadbeef->cond_broadcast( info->ahead_cond );
+    deadbeef->mutex_unlock( info->ahead_mutex );
+
+    return count;
+}
+
+// free whatever a failed load left behind, sparing images owned by the cache
+static void rom_state_free( struct psf_load_state * state )
+{
+    const struct hq_rom_set * base = state->base;
+    if ( !base || state->key != base->key ) rom_image_free( state->key );
+    if ( !base || state->z80_rom != base->z80 ) rom_image_free( state->z80_rom );
+    if ( !base || state->sample_rom != base->samples ) rom_image_free( state->sample_rom );
+}
+
+DB_fileinfo_t *
+hq_open (uint32_t hints) {
+    DB_fileinfo_t *_info = (DB_fileinfo_t *)malloc (sizeof (hq_info_t));
+    memset (_info, 0, sizeof (hq_info_t));
+    return _info;
+}
+
+// the core always renders at this rate
+#define HQ_CORE_RATE 44100
+
+// default length for tracks without a length tag
+#define DEFAULT_SONG_MS ( ( 2 * 60 + 50 ) * 1000 )
+#define DEFAULT_FADE_MS ( 10 * 1000 )
+
+// load a track and prepare its emulator, up to the point playback would start;
+// it is only consulted for a detected length, srate is the rate lengths are counted in
+static int
+hq_load_track (hq_info_t *info, const char *uri, DB_playItem_t *it, int srate) {
+    info->path = strdup( uri );
+
+    struct psf_load_state state;
+    memset( &state, 0, sizeof(state) );
+
+    // only the tags are needed up front, to find the ROM set before anything is loaded
+    if ( qsf_read_lib( uri, state.lib_path ) < 0 ) {
+        trace ("hq: failed to open %s\n", uri);
+        return -1;
+    }
+
+    if ( state.lib_path[0] && deadbeef->conf_get_int( "hq.rom_cache", 1 ) ) {
+        char lib_path[PATH_MAX];
+        rom_lib_path( lib_path, uri, state.lib_path );
+        info->rom = rom_set_acquire( lib_path );
+        if ( info->rom ) {
+            state.base = info->rom;
+            state.key = info->rom->key;
+            state.key_size = info->rom->key_size;
+            state.z80_rom = info->rom->z80;
+            state.z80_size = info->rom->z80_size;
+            state.sample_rom = info->rom->samples;
+            state.sample_size = info->rom->samples_size;
+        }
+    }
+
+    psf_lib_override = info->rom;
+    long faults = rom_faults_now();
+    int err = psf_load( uri, &psf_file_system, 0x41, qsf_load, &state, psf_info_meta, &state ) <= 0;
+    __atomic_add_fetch( &rom_arena.faults, rom_faults_now() - faults, __ATOMIC_RELAXED );
+    psf_lib_override = NULL;
+
+    if ( err ) {
+        rom_state_free( &state );
+        trace( "hq: invalid PSF file\n" );
+        return -1;
+    }
+
+    info->key = state.key;
+    info->key_size = state.key_size;
+    info->z80 = state.z80_rom;
+    info->z80_size = state.z80_size;
+    info->samples = state.sample_rom;
+    info->samples_size = state.sample_size;
+    info->patch_hash = state.patch_hash;
+
+    if ( !info->rom || info->samples != info->rom->samples ) rom_image_settle( info->samples, 1, 0 );
+
+    if ( info->rom && info->key == info->rom->key && info->z80 == info->rom->z80 && info->samples == info->rom->samples ) {
+        info->emu_template = rom_set_template( info->rom );
+    }
+    if ( !info->emu_template ) {
+        info->emu_template_owned = emu_alloc();
+        if ( info->emu_template_owned ) {
+            emu_setup( info->emu_template_owned, info->key, info->key_size, info->z80, info->z80_size,
+                       info->samples, info->samples_size );
+        }
+        info->emu_template = info->emu_template_owned;
+    }
+
+    info->emu = emu_alloc();
+    if ( !info->emu || !info->emu_template ) {
+        trace( "hq: out of memory\n" );
+        return -1;
+    }
+
+    memcpy( info->emu, info->emu_template, qsound_get_state_size() );
+
+    int tag_song_ms = state.tag_song_ms;
+    int tag_fade_ms = state.tag_fade_ms;
+
+    if (!tag_song_ms && it)
+    {
+        deadbeef->pl_lock ();
+        const char * detected = deadbeef->pl_find_meta (it, ":HQ_DETECTED_LENGTH");
+        if (detected) {
+            tag_song_ms = atoi (detected);
+            detected = deadbeef->pl_find_meta (it, ":HQ_DETECTED_FADE");
+            tag_fade_ms = detected ? atoi (detected) : 0;
+        }
+        deadbeef->pl_unlock ();
+    }
+
+    if (!tag_song_ms)
+    {
+        tag_song_ms = DEFAULT_SONG_MS;
+        tag_fade_ms = DEFAULT_FADE_MS;
+    }
+
+    info->samples_played = 0;
+    info->samples_to_play = (uint64_t)tag_song_ms * (uint64_t)srate / 1000;
+    info->samples_to_fade = (uint64_t)tag_fade_ms * (uint64_t)srate / 1000;
+    info->emu_length = info->samples_to_play + info->samples_to_fade;
+    info->length_ms = tag_song_ms + tag_fade_ms;
+
+    return 0;
+}
+
+// rendered core output kept on disk, one file per track under <config>/hq_pcm, named
+// after a hash of the ROM images and the length. Files are plain frames after a short
+// header so they can be mapped; mtime marks the last use for LRU eviction
+#define PCM_MAGIC "HQPC"
+#define PCM_VERSION 1
+#define PCM_HEADER_SIZE 16
+#define PCM_MAX_PENDING 8
+#define PCM_CHUNK 4096
+#define PCM_PART_STALE 3600   // seconds a render file goes unwritten before it counts as abandoned
+
+void hq_free (DB_fileinfo_t *_info);
+
+typedef struct {
+    char *path;
+    uint64_t key;
+    int frames;
+} pcm_job_t;
+
+// keys being rendered in the background, guarded by hq_mutex
+static uint64_t pcm_pending[ PCM_MAX_PENDING ];
+static int pcm_pending_count;
+
+// frames cover the resampler's look-ahead past the end of the fade at any output rate
+static int pcm_frames( const hq_info_t * info )
+{
+    return (uint64_t)info->length_ms * HQ_CORE_RATE / 1000 + RS_TAPS;
+}
+
+// a track on a cached set is its set's digest plus what the track loads over it, so
+// opening one does not read through megabytes of ROM
+static uint64_t pcm_key( const hq_info_t * info )
+{
+    uint32_t sizes[4] = { info->key_size, info->z80_size, info->samples_size, pcm_frames( info ) };
+    uint64_t h = hash_data( HASH_SEED, sizes, sizeof( sizes ) );
+    if ( info->rom ) {
+        uint64_t parts[2] = { rom_set_digest( info->rom ), info->patch_hash };
+        return hash_data( h, parts, sizeof( parts ) );
+    }
+    h = hash_data( h, info->key, info->key_size );
+    h = hash_data( h, info->z80, info->z80_size );
+    return hash_data( h, info->samples, info->samples_size );
+}
+
+static void pcm_path( char * out, size_t size, uint64_t key, const char * suffix )
+{
+    snprintf( out, size, "%s/hq_pcm/%016llx.pcm%s", deadbeef->get_config_dir(), (unsigned long long) key, suffix );
+}
+
+// map a complete cache file for the track, if there is one
+static int pcm_attach( hq_info_t * info )
+{
+    char path[PATH_MAX];
+    pcm_path( path, sizeof( path ), info->pcm_key, "" );
+
+    int fd = open( path, O_RDONLY );
+    if ( fd < 0 ) return -1;
+
+    struct stat st;
+    size_t size = (size_t) pcm_frames( info ) * 2 * sizeof(short) + PCM_HEADER_SIZE;
+    if ( fstat( fd, &st ) < 0 || st.st_size != (off_t) size ) {
+        close( fd );
+        return -1;
+    }
+    void * map = mmap( NULL, size, PROT_READ, MAP_SHARED, fd, 0 );
+    close( fd );
+    if ( map == MAP_FAILED ) return -1;
+
+    uint32_t header[4];
+    memcpy( header, map, sizeof( header ) );
+    if ( memcmp( header, PCM_MAGIC, 4 ) || header[1] != PCM_VERSION || header[2] != (uint32_t) pcm_frames( info ) ) {
+        munmap( map, size );
+        return -1;
+    }
+
+    info->pcm_map = map;
+    info->pcm_map_size = size;
+    info->pcm = (const short *)( (const char *) map + PCM_HEADER_SIZE );
+    info->pcm_frames = header[2];
+    madvise( map, size, MADV_SEQUENTIAL );
+    utime( path, NULL );
+    return 0;
+}
+
+static void pcm_detach( hq_info_t * info )
+{
+    if ( info->pcm_map ) {
+        munmap( info->pcm_map, info->pcm_map_size );
+        info->pcm_map = NULL;
+        info->pcm = NULL;
+    }
+}
+
+// least recently used files go first until the cache fits hq.pcm_cache_size megabytes;
+// renders in progress count against it too, and ones left by a crash are removed
+static void pcm_evict( void )
+{
+    char dir_path[PATH_MAX];
+    snprintf( dir_path, sizeof( dir_path ), "%s/hq_pcm", deadbeef->get_config_dir() );
+    uint64_t limit = (uint64_t) deadbeef->conf_get_int( "hq.pcm_cache_size", 1024 ) * 1024 * 1024;
+
+    for (;;) {
+        DIR * dir = opendir( dir_path );
+        if ( !dir ) return;
+
+        uint64_t total = 0;
+        char oldest[PATH_MAX] = "";
+        time_t oldest_time = 0;
+        struct dirent * de;
+        while ( ( de = readdir( dir ) ) ) {
+            size_t len = strlen( de->d_name );
+            int part = strstr( de->d_name, ".pcm.part" ) != NULL;
+            if ( !part && ( len < 4 || strcmp( de->d_name + len - 4, ".pcm" ) ) ) continue;
+            char path[PATH_MAX];
+            struct stat st;
+            if ( snprintf( path, sizeof( path ), "%s/%s", dir_path, de->d_name ) >= (int) sizeof( path ) ) continue;
+            if ( stat( path, &st ) < 0 ) continue;
+            if ( part ) {
+                if ( st.st_mtime < time( NULL ) - PCM_PART_STALE ) unlink( path );
+                else total += st.st_size;
+                continue;
+            }
+            total += st.st_size;
+            if ( !oldest[0] || st.st_mtime < oldest_time ) {
+                strcpy( oldest, path );
+                oldest_time = st.st_mtime;
+            }
+        }
+        closedir( dir );
+
+        // a mapped file stays readable after unlink, so playing tracks are not disturbed
+        if ( total <= limit || !oldest[0] || unlink( oldest ) < 0 ) return;
+    }
+}
+
+static void pcm_pending_remove( uint64_t key )
+{
+    deadbeef->mutex_lock( hq_mutex );
+    for ( int i = 0; i < pcm_pending_count; i++ ) {
+        if ( pcm_pending[ i ] == key ) {
+            pcm_pending[ i ] = pcm_pending[ --pcm_pending_count ];
+            break;
+        }
+    }
+    deadbeef->mutex_unlock( hq_mutex );
+}
+
+static void pcm_job_free( pcm_job_t * job )
+{
+    pcm_pending_remove( job->key );
+    free( job->path );
+    free( job );
+}
+
+static void pcm_job_cancel( void * ctx )
+{
+    pcm_job_free( (pcm_job_t *) ctx );
+}
+
+// render the whole track with an emulator of its own, then publish it under the final name
+static void pcm_job_run( void * ctx )
+{
+    pcm_job_t * job = (pcm_job_t *) ctx;
+    hq_info_t * info = calloc( 1, sizeof( hq_info_t ) );
+    short * buffer = malloc( PCM_CHUNK * 2 * sizeof(short) );
+    char part[PATH_MAX], path[PATH_MAX];
+    FILE * f = NULL;
+
+    pcm_path( path, sizeof( path ), job->key, "" );
+    // other processes may render the same track, each into its own file
+    pcm_path( part, sizeof( part ), job->key, ".part.XXXXXX" );
+
+    int fd = -1;
+    if ( info && buffer && hq_load_track( info, job->path, NULL, HQ_CORE_RATE ) == 0 && ( fd = mkstemp( part ) ) >= 0 ) {
+        fchmod( fd, 0644 );
+        if ( !( f = fdopen( fd, "wb" ) ) ) {
+            close( fd );
+            unlink( part );
+        }
+    }
+    if ( f ) {
+        uint32_t header[4] = { 0, PCM_VERSION, job->frames, 2 };
+        memcpy( header, PCM_MAGIC, 4 );
+        int ok = fwrite( header, sizeof( header ), 1, f ) == 1;
+        int done = 0;
+        while ( ok && done < job->frames && !pool_stopping() ) {
+            uint32_t count = min( job->frames - done, PCM_CHUNK );
+            ok = hq_render( info, buffer, &count ) == 0 && count && fwrite( buffer, 2 * sizeof(short), count, f ) == count;
+            done += count;
+        }
+        ok = fclose( f ) == 0 && ok && done == job->frames;
+        if ( ok && rename( part, path ) == 0 ) {
+            pcm_evict();
+        }
+        else {
+            unlink( part );
+        }
+    }
+
+    if ( info ) hq_free( (DB_fileinfo_t *) info );
+    free( buffer );
+    pcm_job_free( job );
+}
+
+// queue a background render of the track unless one is already running
+static void pcm_queue( hq_info_t * info )
+{
+    char dir_path[PATH_MAX];
+    snprintf( dir_path, sizeof( dir_path ), "%s/hq_pcm", deadbeef->get_config_dir() );
+    mkdir( dir_path, 0755 );
+
+    deadbeef->mutex_lock( hq_mutex );
+    int i;
+    for ( i = 0; i < pcm_pending_count; i++ ) {
+        if ( pcm_pending[ i ] == info->pcm_key ) break;
+    }
+    if ( i < pcm_pending_count || pcm_pending_count == PCM_MAX_PENDING ) {
+        deadbeef->mutex_unlock( hq_mutex );
+        return;
+    }
+    pcm_pending[ pcm_pending_count++ ] = info->pcm_key;
+    deadbeef->mutex_unlock( hq_mutex );
+
+    pcm_job_t * job = malloc( sizeof( pcm_job_t ) );
+    if ( !job || !( job->path = strdup( info->path ) ) ) {
+        free( job );
+        pcm_pending_remove( info->pcm_key );
+        return;
+    }
+    job->key = info->pcm_key;
+    job->frames = pcm_frames( info );
+    if ( pool_submit_slow( pcm_job_run, pcm_job_cancel, job ) < 0 ) {
+        pcm_job_free( job );
+    }
+}
+
+// hq.preload loads the next playlist item in the background once the current one is about
+// to end, so the track change does not wait on file reads and emulator setup. A single
+// warm instance is kept; hq_init takes it over when it is for the same file and rate
+#define PRELOAD_LEAD 5
+
+static struct {
+    char *uri;
+    int srate;
+    hq_info_t *info;    // the loaded instance, NULL while pending or if loading failed
+    int pending;        // PRELOAD_QUEUED or PRELOAD_LOADING until the job is done
+    unsigned serial;    // bumped whenever the slot is emptied
+} preload;
+
+enum { PRELOAD_QUEUED = 1, PRELOAD_LOADING };
+
+// signalled when a pending preload finishes, guarded by hq_mutex
+static uintptr_t preload_cond;
+
+typedef struct {
+    char *uri;
+    int srate;
+    unsigned serial;
+    DB_playItem_t *it;
+} preload_job_t;
+
+// empty the slot with hq_mutex held; what it held is returned, to be freed without the lock
+static hq_info_t * preload_clear( void )
+{
+    hq_info_t * warm = preload.info;
+    if ( preload.uri ) free( preload.uri );
+    preload.uri = NULL;
+    preload.info = NULL;
+    preload.pending = 0;
+    preload.serial++;
+    deadbeef->cond_broadcast( preload_cond );
+    return warm;
+}
+
+static void preload_job_free( preload_job_t * job )
+{
+    deadbeef->pl_item_unref( job->it );
+    free( job->uri );
+    free( job );
+}
+
+static void preload_job_cancel( void * ctx )
+{
+    preload_job_t * job = ( preload_job_t * ) ctx;
+    deadbeef->mutex_lock( hq_mutex );
+    if ( preload.serial == job->serial ) preload_clear();
+    deadbeef->mutex_unlock( hq_mutex );
+    preload_job_free( job );
+}
+
+static void preload_job_run( void * ctx )
+{
+    preload_job_t * job = ( preload_job_t * ) ctx;
+
+    deadbeef->mutex_lock( hq_mutex );
+    int wanted = preload.serial == job->serial;
+    if ( wanted ) preload.pending = PRELOAD_LOADING;
+    deadbeef->mutex_unlock( hq_mutex );
+    if ( !wanted ) {
+        // hq_init got there first and loaded the track itself
+        preload_job_free( job );
+        return;
+    }
+
+    hq_info_t * info = ( hq_info_t * ) hq_open( 0 );
+    if ( info && hq_load_track( info, job->uri, job->it, job->srate ) < 0 ) {
+        hq_free( &info->info );
+        info = NULL;
+    }
+
+    deadbeef->mutex_lock( hq_mutex );
+    if ( preload.serial == job->serial ) {
+        preload.info = info;
+        preload.pending = 0;
+        info = NULL;
+        deadbeef->cond_broadcast( preload_cond );
+    }
+    deadbeef->mutex_unlock( hq_mutex );
+
+    // nobody wants it anymore
+    if ( info ) hq_free( &info->info );
+    preload_job_free( job );
+}
+
+static void preload_next( hq_info_t * info, int srate )
+{
+    DB_playItem_t * next = deadbeef->pl_get_next( info->it, PL_MAIN );
+    if ( !next ) return;
+
+    char * uri = NULL;
+    deadbeef->pl_lock();
+    const char * filetype = deadbeef->pl_find_meta( next, ":FILETYPE" );
+    const char * next_uri = deadbeef->pl_find_meta( next, ":URI" );
+    if ( filetype && next_uri && !strcmp( filetype, "QSF" ) ) uri = strdup( next_uri );
+    deadbeef->pl_unlock();
+
+    preload_job_t * job = uri ? malloc( sizeof( preload_job_t ) ) : NULL;
+    if ( !job || !( job->uri = strdup( uri ) ) ) {
+        if ( job ) free( job );
+        if ( uri ) free( uri );
+        deadbeef->pl_item_unref( next );
+        return;
+    }
+    job->srate = srate;
+    job->it = next;
+
+    deadbeef->mutex_lock( hq_mutex );
+    if ( preload.uri && preload.srate == srate && !strcmp( preload.uri, uri ) ) {
+        // already warm or on its way
+        deadbeef->mutex_unlock( hq_mutex );
+        free( uri );
+        preload_job_free( job );
+        return;
+    }
+    hq_info_t * stale = preload_clear();
+    preload.uri = uri;
+    preload.srate = srate;
+    preload.pending = PRELOAD_QUEUED;
+    job->serial = preload.serial;
+    deadbeef->mutex_unlock( hq_mutex );
+
+    if ( stale ) hq_free( &stale->info );
+    if ( pool_submit( preload_job_run, preload_job_cancel, job ) < 0 ) {
+        preload_job_cancel( job );
+    }
+}
+
+// the warm instance for uri, waiting for it if it is already loading; NULL if there is
+// none. A preload still queued behind other jobs is dropped, loading it here is quicker
+// than waiting for its turn
+static hq_info_t * preload_take( const char * uri, int srate )
+{
+    hq_info_t * warm = NULL;
+    deadbeef->mutex_lock( hq_mutex );
+    if ( preload.uri && preload.srate == srate && !strcmp( preload.uri, uri ) ) {
+        unsigned serial = preload.serial;
+        if ( preload.pending == PRELOAD_QUEUED ) {
+            preload_clear();
+            deadbeef->mutex_unlock( hq_mutex );
+            return NULL;
+        }
+        while ( preload.pending && preload.serial == serial ) {
+            deadbeef->cond_wait( preload_cond, hq_mutex );
+        }
+        if ( preload.serial == serial ) {
+            warm = preload_clear();
+        }
+    }
+    deadbeef->mutex_unlock( hq_mutex );
+    return warm;
+}
+
+// drop the warm instance at shutdown, after the pool has stopped
+static void preload_flush( void )
+{
+    deadbeef->mutex_lock( hq_mutex );
+    hq_info_t * warm = preload_clear();
+    deadbeef->mutex_unlock( hq_mutex );
+    if ( warm ) hq_free( &warm->info );
+}
+
+int
+hq_init (DB_fileinfo_t *_info, DB_playItem_t *it) {
+    hq_info_t *info = (hq_info_t *)_info;
+
+    deadbeef->pl_lock ();
+    char * uri = strdup( deadbeef->pl_find_meta (it, ":URI") );
+    deadbeef->pl_unlock ();
+
+    // hq.samplerate other than 0 or the core rate resamples in the plugin, so the
+    // host does not have to
+    int srate = deadbeef->conf_get_int( "hq.samplerate", 0 );
+    if ( srate < 8000 || srate > 192000 ) srate = HQ_CORE_RATE;
+
+    HQ_STAT( uint64_t load_start = hq_stats_now(); )
+    int err = 0;
+    hq_info_t * warm = preload_take( uri, srate );
+    if ( warm ) {
+        // everything hq_load_track sets up moves over, the rest is still zero in both
+        memcpy( info, warm, sizeof( hq_info_t ) );
+        free( warm );
+    }
+    else {
+        err = hq_load_track( info, uri, it, srate );
+    }
+    HQ_STAT( info->stats.load_ns = hq_stats_now() - load_start; )
+    free( uri );
+    if ( err < 0 ) {
+        return -1;
+    }
+
+    if ( srate != HQ_CORE_RATE ) {
+        info->rs = rs_create( HQ_CORE_RATE, srate );
+        if ( !info->rs ) {
+            return -1;
+        }
+        rs_reset( info->rs, 0 );
+        info->emu_length = rs_core_needed( info->rs, info->samples_to_play + info->samples_to_fade );
+    }
+
+    // hq.pcm_cache plays from a previous render when there is one, and makes one otherwise
+    if ( deadbeef->conf_get_int( "hq.pcm_cache", 0 ) ) {
+        info->pcm_key = pcm_key( info );
+        if ( pcm_attach( info ) < 0 ) {
+            pcm_queue( info );
+        }
+    }
+
+    int snapshot_mb = deadbeef->conf_get_int( "hq.seek_snapshot_memory", 16 );
+    if ( snapshot_mb > 0 ) {
+        info->snapshot_max = (uint64_t)snapshot_mb * 1024 * 1024 / qsound_get_state_size();
+        if ( info->snapshot_max > 1 ) {
+            info->snapshots = calloc( info->snapshot_max, sizeof( hq_snapshot_t ) );
+        }
+        if ( !info->snapshots ) info->snapshot_max = 0;
+        info->snapshot_interval = deadbeef->conf_get_int( "hq.seek_snapshot_interval", 5 ) * HQ_CORE_RATE;
+        if ( info->snapshot_interval <= 0 ) info->snapshot_interval = HQ_CORE_RATE;
+    }
+
+    // hq.render_block frames per emulator call, 0 renders exactly what each read asks for
+    int block_frames = deadbeef->conf_get_int( "hq.render_block", 4096 );
+    if ( block_frames > 0 ) {
+        if ( block_frames > ( 1 << 20 ) ) block_frames = 1 << 20;
+        if ( !posix_memalign( (void **) &info->block, 64, block_frames * 2 * sizeof(short) ) ) {
+            info->block_frames = block_frames;
+        }
+        else {
+            info->block = NULL;
+        }
+    }
+
+    int ring_frames = deadbeef->conf_get_int( "hq.render_ahead_frames", 32768 );
+    if ( deadbeef->conf_get_int( "hq.render_ahead", 0 ) && ring_frames > 0 && !info->pcm ) {
+        info->ring_frames = 1024;
+        while ( info->ring_frames < (unsigned) ring_frames && info->ring_frames < ( 1 << 24 ) ) info->ring_frames *= 2;
+        info->ring = malloc( info->ring_frames * 2 * sizeof(short) );
+        if ( info->ring ) {
+            info->ahead_mutex = deadbeef->mutex_create();
+            info->ahead_cond = deadbeef->cond_create();
+            hq_ahead_start( info );
+        }
+    }
+
+    // hq.output_gain is in dB, hq.output_replaygain adds the track (1) or album (2)
+    // gain from the tags, for hosts that leave ReplayGain off
+    float gain_db = deadbeef->conf_get_float( "hq.output_gain", 0.f );
+    float peak = 1.f;
+    int rg_mode = deadbeef->conf_get_int( "hq.output_replaygain", 0 );
+    if ( rg_mode == 1 || rg_mode == 2 ) {
+        gain_db += deadbeef->pl_get_item_replaygain( it, rg_mode == 1 ? DDB_REPLAYGAIN_TRACKGAIN : DDB_REPLAYGAIN_ALBUMGAIN );
+        peak = deadbeef->pl_get_item_replaygain( it, rg_mode == 1 ? DDB_REPLAYGAIN_TRACKPEAK : DDB_REPLAYGAIN_ALBUMPEAK );
+        if ( peak <= 0.f ) peak = 1.f;
+    }
+    info->gain = powf( 10.f, gain_db / 20.f );
+    if ( info->gain * peak > 1.f && rg_mode ) info->gain = 1.f / peak;
+    info->output_float = deadbeef->conf_get_int( "hq.output_float", 0 );
+
+    if ( deadbeef->conf_get_int( "hq.preload", 0 ) ) {
+        int total = info->samples_to_play + info->samples_to_fade;
+        info->preload_at = max( 1, min( info->samples_to_play, total - PRELOAD_LEAD * srate ) );
+        info->it = it;
+        deadbeef->pl_item_ref( it );
+    }
+
+#ifdef HQ_STATS
+    // hq.stats_log logs the counters every that many seconds of output, and when the track closes
+    int stats_log = deadbeef->conf_get_int( "hq.stats_log", 0 );
+    if ( stats_log > 0 ) {
+        info->stats_log_frames = (uint64_t) stats_log * srate;
+        info->stats_next_log = info->stats_log_frames;
+    }
+#endif
+
+    _info->plugin = &hq_plugin;
+    _info->fmt.channels = 2;
+    _info->fmt.bps = info->output_float ? 32 : 16;
+    _info->fmt.is_float = info->output_float;
+    _info->fmt.samplerate = srate;
+    _info->fmt.channelmask = _info->fmt.channels == 1 ? DDB_SPEAKER_FRONT_LEFT : (DDB_SPEAKER_FRONT_LEFT | DDB_SPEAKER_FRONT_RIGHT);
+    _info->readpos = 0;
+
+    return 0;
+}
+
+void
+hq_free (DB_fileinfo_t *_info) {
+    hq_info_t *info = (hq_info_t *)_info;
+    if (info) {
+        if (info->ahead_tid) {
+            hq_ahead_stop (info);
+        }
+#ifdef HQ_STATS
+        if (info->stats_log_frames) {
+            hq_stats_log (info, "close");
+        }
+#endif
+        if (info->ahead_mutex) {
+            deadbeef->mutex_free (info->ahead_mutex);
+            info->ahead_mutex = 0;
+        }
+        if (info->ahead_cond) {
+            deadbeef->cond_free (info->ahead_cond);
+            info->ahead_cond = 0;
+        }
+        if (info->ring) {
+            free (info->ring);
+            info->ring = NULL;
+        }
+        if (info->scratch) {
+            free (info->scratch);
+            info->scratch = NULL;
+        }
+        if (info->rs) {
+            rs_free (info->rs);
+            info->rs = NULL;
+        }
+        if (info->block) {
+            free (info->block);
+            info->block = NULL;
+        }
+        pcm_detach (info);
+        if (info->it) {
+            deadbeef->pl_item_unref (info->it);
+            info->it = NULL;
+        }
+        if (info->samples && (!info->rom || info->samples != info->rom->samples)) {
+            rom_image_free (info->samples);
+        }
+        info->samples = NULL;
+        if (info->z80 && (!info->rom || info->z80 != info->rom->z80)) {
+            rom_image_free (info->z80);
+        }
+        info->z80 = NULL;
+        if (info->key && (!info->rom || info->key != info->rom->key)) {
+            rom_image_free (info->key);
+        }
+        info->key = NULL;
+        if (info->rom) {
+            rom_set_release (info->rom);
+            info->rom = NULL;
+        }
+        if (info->emu) {
+            emu_release (info->emu);
+            info->emu = NULL;
+        }
+        if (info->emu_template_owned) {
+            emu_release (info->emu_template_owned);
+            info->emu_template_owned = NULL;
+        }
+        info->emu_template = NULL;
+        if (info->snapshots) {
+            for (int i = 0; i < info->snapshot_max; i++) {
+                if (info->snapshots[i].state) {
+                    free (info->snapshots[i].state);
+                }
+            }
+            free (info->snapshots);
+            info->snapshots = NULL;
+        }
+        if (info->path) {
+            free (info->path);
+            info->path = NULL;
+        }
+        free (info);
+    }
+}
+
+// output stage: the fade ramp and fixed gain are applied in one pass. Each frame
+// gets level + slope * (ramp - i), exact integers until the multiply, so the
+// result does not depend on how reads split the track and the loops vectorize
+static void hq_output_s16 (short *samples, int frames, float level, float slope, int ramp) {
+    for (int i = 0; i < frames; i++) {
+        float g = level + slope * (float)( ramp - i );
+        float l = samples[i * 2 + 0] * g;
+        float r = samples[i * 2 + 1] * g;
+        l = l > 32767.f ? 32767.f : l;
+        l = l < -32768.f ? -32768.f : l;
+        r = r > 32767.f ? 32767.f : r;
+        r = r < -32768.f ? -32768.f : r;
+        samples[i * 2 + 0] = (short)l;
+        samples[i * 2 + 1] = (short)r;
+    }
+}
+
+static void hq_output_float (float * restrict out, const short * restrict in, int frames, float level, float slope, int ramp) {
+    level *= 1.f / 32768.f;
+    slope *= 1.f / 32768.f;
+    for (int i = 0; i < frames; i++) {
+        float g = level + slope * (float)( ramp - i );
+        out[i * 2 + 0] = in[i * 2 + 0] * g;
+        out[i * 2 + 1] = in[i * 2 + 1] * g;
+    }
+}
+
+// the same from resampler output
+static void hq_output_rs_s16 (short * restrict out, const float * restrict in, int frames, float level, float slope, int ramp) {
+    for (int i = 0; i < frames; i++) {
+        float g = level + slope * (float)( ramp - i );
+        float l = in[i * 2 + 0] * g;
+        float r = in[i * 2 + 1] * g;
+        l = l > 32767.f ? 32767.f : l;
+        l = l < -32768.f ? -32768.f : l;
+        r = r > 32767.f ? 32767.f : r;
+        r = r < -32768.f ? -32768.f : r;
+        out[i * 2 + 0] = (short)l;
+        out[i * 2 + 1] = (short)r;
+    }
+}
+
+static void hq_output_rs_float (float * restrict out, const float * restrict in, int frames, float level, float slope, int ramp) {
+    level *= 1.f / 32768.f;
+    slope *= 1.f / 32768.f;
+    for (int i = 0; i < frames; i++) {
+        float g = level + slope * (float)( ramp - i );
+        out[i * 2 + 0] = in[i * 2 + 0] * g;
+        out[i * 2 + 1] = in[i * 2 + 1] * g;
+    }
+}
+
+#ifdef HQ_X86
+// the same four frames at a time. Gains and clamping match the loops above operation for
+// operation, and the remainder goes to them, so the output does not change
+__attribute__ ((target ("sse2")))
+static inline __m128 hq_gain_sse2 (float level, float slope, int ramp) {
+    __m128i r = _mm_set_epi32( ramp - 1, ramp - 1, ramp, ramp );
+    return _mm_add_ps( _mm_set1_ps( level ), _mm_mul_ps( _mm_set1_ps( slope ), _mm_cvtepi32_ps( r ) ) );
+}
+
+__attribute__ ((target ("sse2")))
+static inline __m128i hq_clamp_pack_sse2 (__m128 a, __m128 b) {
+    const __m128 lo = _mm_set1_ps( -32768.f ), hi = _mm_set1_ps( 32767.f );
+    a = _mm_max_ps( _mm_min_ps( a, hi ), lo );
+    b = _mm_max_ps( _mm_min_ps( b, hi ), lo );
+    return _mm_packs_epi32( _mm_cvttps_epi32( a ), _mm_cvttps_epi32( b ) );
+}
+
+__attribute__ ((target ("sse2")))
+static void hq_output_s16_sse2 (short *samples, int frames, float level, float slope, int ramp) {
+    int i;
+    for (i = 0; i + 4 <= frames; i += 4) {
+        __m128i v = _mm_loadu_si128( (const __m128i *)( samples + i * 2 ) );
+        __m128 a = _mm_cvtepi32_ps( _mm_srai_epi32( _mm_unpacklo_epi16( v, v ), 16 ) );
+        __m128 b = _mm_cvtepi32_ps( _mm_srai_epi32( _mm_unpackhi_epi16( v, v ), 16 ) );
+        a = _mm_mul_ps( a, hq_gain_sse2( level, slope, ramp - i ) );
+        b = _mm_mul_ps( b, hq_gain_sse2( level, slope, ramp - i - 2 ) );
+        _mm_storeu_si128( (__m128i *)( samples + i * 2 ), hq_clamp_pack_sse2( a, b ) );
+    }
+    hq_output_s16( samples + i * 2, frames - i, level, slope, ramp - i );
+}
+
+__attribute__ ((target ("sse2")))
+static void hq_output_float_sse2 (float * restrict out, const short * restrict in, int frames, float level, float slope, int ramp) {
+    int i;
+    float l = level * ( 1.f / 32768.f ), s = slope * ( 1.f / 32768.f );
+    for (i = 0; i + 4 <= frames; i += 4) {
+        __m128i v = _mm_loadu_si128( (const __m128i *)( in + i * 2 ) );
+        __m128 a = _mm_cvtepi32_ps( _mm_srai_epi32( _mm_unpacklo_epi16( v, v ), 16 ) );
+        __m128 b = _mm_cvtepi32_ps( _mm_srai_epi32( _mm_unpackhi_epi16( v, v ), 16 ) );
+        _mm_storeu_ps( out + i * 2, _mm_mul_ps( a, hq_gain_sse2( l, s, ramp - i ) ) );
+        _mm_storeu_ps( out + i * 2 + 4, _mm_mul_ps( b, hq_gain_sse2( l, s, ramp - i - 2 ) ) );
+    }
+    hq_output_float( out + i * 2, in + i * 2, frames - i, level, slope, ramp - i );
+}
+
+__attribute__ ((target ("sse2")))
+static void hq_output_rs_s16_sse2 (short * restrict out, const float * restrict in, int frames, float level, float slope, int ramp) {
+    int i;
+    for (i = 0; i + 4 <= frames; i += 4) {
+        __m128 a = _mm_mul_ps( _mm_loadu_ps( in + i * 2 ), hq_gain_sse2( level, slope, ramp - i ) );
+        __m128 b = _mm_mul_ps( _mm_loadu_ps( in + i * 2 + 4 ), hq_gain_sse2( level, slope, ramp - i - 2 ) );
+        _mm_storeu_si128( (__m128i *)( out + i * 2 ), hq_clamp_pack_sse2( a, b ) );
+    }
+    hq_output_rs_s16( out + i * 2, in + i * 2, frames - i, level, slope, ramp - i );
+}
+
+__attribute__ ((target ("sse2")))
+static void hq_output_rs_float_sse2 (float * restrict out, const float * restrict in, int frames, float level, float slope, int ramp) {
+    int i;
+    float l = level * ( 1.f / 32768.f ), s = slope * ( 1.f / 32768.f );
+    for (i = 0; i + 4 <= frames; i += 4) {
+        _mm_storeu_ps( out + i * 2, _mm_mul_ps( _mm_loadu_ps( in + i * 2 ), hq_gain_sse2( l, s, ramp - i ) ) );
+        _mm_storeu_ps( out + i * 2 + 4, _mm_mul_ps( _mm_loadu_ps( in + i * 2 + 4 ), hq_gain_sse2( l, s, ramp - i - 2 ) ) );
+    }
+    hq_output_rs_float( out + i * 2, in + i * 2, frames - i, level, slope, ramp - i );
+}
+
+// eight frames at a time
+__attribute__ ((target ("avx2")))
+static inline __m256 hq_gain_avx2 (float level, float slope, int ramp) {
+    __m256i r = _mm256_set_epi32( ramp - 3, ramp - 3, ramp - 2, ramp - 2, ramp - 1, ramp - 1, ramp, ramp );
+    return _mm256_add_ps( _mm256_set1_ps( level ), _mm256_mul_ps( _mm256_set1_ps( slope ), _mm256_cvtepi32_ps( r ) ) );
+}
+
+__attribute__ ((target ("avx2")))
+static inline __m128i hq_clamp_pack_avx2 (__m256 a) {
+    a = _mm256_max_ps( _mm256_min_ps( a, _mm256_set1_ps( 32767.f ) ), _mm256_set1_ps( -32768.f ) );
+    __m256i v = _mm256_cvttps_epi32( a );
+    return _mm_packs_epi32( _mm256_castsi256_si128( v ), _mm256_extracti128_si256( v, 1 ) );
+}
+
+__attribute__ ((target ("avx2")))
+static void hq_output_s16_avx2 (short *samples, int frames, float level, float slope, int ramp) {
+    int i;
+    for (i = 0; i + 8 <= frames; i += 8) {
+        __m256 a = _mm256_cvtepi32_ps( _mm256_cvtepi16_epi32( _mm_loadu_si128( (const __m128i *)( samples + i * 2 ) ) ) );
+        __m256 b = _mm256_cvtepi32_ps( _mm256_cvtepi16_epi32( _mm_loadu_si128( (const __m128i *)( samples + i * 2 + 8 ) ) ) );
+        a = _mm256_mul_ps( a, hq_gain_avx2( level, slope, ramp - i ) );
+        b = _mm256_mul_ps( b, hq_gain_avx2( level, slope, ramp - i - 4 ) );
+        _mm_storeu_si128( (__m128i *)( samples + i * 2 ), hq_clamp_pack_avx2( a ) );
+        _mm_storeu_si128( (__m128i *)( samples + i * 2 + 8 ), hq_clamp_pack_avx2( b ) );
+    }
+    hq_output_s16( samples + i * 2, frames - i, level, slope, ramp - i );
+}
+
+__attribute__ ((target ("avx2")))
+static void hq_output_float_avx2 (float * restrict out, const short * restrict in, int frames, float level, float slope, int ramp) {
+    int i;
+    float l = level * ( 1.f / 32768.f ), s = slope * ( 1.f / 32768.f );
+    for (i = 0; i + 4 <= frames; i += 4) {
+        __m256 a = _mm256_cvtepi32_ps( _mm256_cvtepi16_epi32( _mm_loadu_si128( (const __m128i *)( in + i * 2 ) ) ) );
+        _mm256_storeu_ps( out + i * 2, _mm256_mul_ps( a, hq_gain_avx2( l, s, ramp - i ) ) );
+    }
+    hq_output_float( out + i * 2, in + i * 2, frames - i, level, slope, ramp - i );
+}
+
+__attribute__ ((target ("avx2")))
+static void hq_output_rs_s16_avx2 (short * restrict out, const float * restrict in, int frames, float level, float slope, int ramp) {
+    int i;
+    for (i = 0; i + 4 <= frames; i += 4) {
+        __m256 a = _mm256_mul_ps( _mm256_loadu_ps( in + i * 2 ), hq_gain_avx2( level, slope, ramp - i ) );
+        _mm_storeu_si128( (__m128i *)( out + i * 2 ), hq_clamp_pack_avx2( a ) );
+    }
+    hq_output_rs_s16( out + i * 2, in + i * 2, frames - i, level, slope, ramp - i );
+}
+
+__attribute__ ((target ("avx2")))
+static void hq_output_rs_float_avx2 (float * restrict out, const float * restrict in, int frames, float level, float slope, int ramp) {
+    int i;
+    float l = level * ( 1.f / 32768.f ), s = slope * ( 1.f / 32768.f );
+    for (i = 0; i + 4 <= frames; i += 4) {
+        _mm256_storeu_ps( out + i * 2, _mm256_mul_ps( _mm256_loadu_ps( in + i * 2 ), hq_gain_avx2( l, s, ramp - i ) ) );
+    }
+    hq_output_rs_float( out + i * 2, in + i * 2, frames - i, level, slope, ramp - i );
+}
+#endif
+
+static void hq_kernels_select (int simd) {
+    hq_kernels.rs_run = rs_run;
+    hq_kernels.output_s16 = hq_output_s16;
+    hq_kernels.output_float = hq_output_float;
+    hq_kernels.output_rs_s16 = hq_output_rs_s16;
+    hq_kernels.output_rs_float = hq_output_rs_float;
+    hq_kernels.name = "portable";
+#ifdef HQ_X86
+    if ( !simd ) return;
+    __builtin_cpu_init();
+    if ( __builtin_cpu_supports( "avx2" ) ) {
+        hq_kernels.rs_run = rs_run_avx2;
+        hq_kernels.output_s16 = hq_output_s16_avx2;
+        hq_kernels.output_float = hq_output_float_avx2;
+        hq_kernels.output_rs_s16 = hq_output_rs_s16_avx2;
+        hq_kernels.output_rs_float = hq_output_rs_float_avx2;
+        hq_kernels.name = "avx2";
+    }
+    else if ( __builtin_cpu_supports( "sse2" ) ) {
+        hq_kernels.output_s16 = hq_output_s16_sse2;
+        hq_kernels.output_float = hq_output_float_sse2;
+        hq_kernels.output_rs_s16 = hq_output_rs_s16_sse2;
+        hq_kernels.output_rs_float = hq_output_rs_float_sse2;
+        hq_kernels.name = "sse2";
+    }
+#endif
+}
+
+static void hq_output_span (hq_info_t *info, char *out, const void *in, int offset, int frames, float level, float slope, int ramp) {
+    if ( info->rs ) {
+        const float *src = (const float *) in + offset * 2;
+        if ( info->output_float ) hq_kernels.output_rs_float( (float *) out + offset * 2, src, frames, level, slope, ramp );
+        else hq_kernels.output_rs_s16( (short *) out + offset * 2, src, frames, level, slope, ramp );
+    }
+    else if ( info->output_float ) {
+        hq_kernels.output_float( (float *) out + offset * 2, (const short *) in + offset * 2, frames, level, slope, ramp );
+    }
+    else if ( slope != 0.f || level != 1.f ) {
+        hq_kernels.output_s16( (short *) out + offset * 2, frames, level, slope, ramp );
+    }
+}
+
+// frames run from samples_start, the fade ends the track at samples_to_play + samples_to_fade;
+// in is 16-bit, processed in place when writing 16-bit, or the resampler's float output
+static void hq_output (hq_info_t *info, char *out, const void *in, int samples_start, int frames) {
+    int fade_start = info->samples_to_play - samples_start;
+    if ( fade_start > frames ) fade_start = frames;
+    if ( fade_start < 0 ) fade_start = 0;
+
+    if ( fade_start ) {
+        hq_output_span( info, out, in, 0, fade_start, info->gain, 0.f, 0 );
+    }
+
+    if ( fade_start < frames ) {
+        // gain falls linearly from 1 at samples_to_play to 0 at the end of the fade
+        float slope = info->gain / info->samples_to_fade;
+        int ramp = info->samples_to_play + info->samples_to_fade - samples_start - fade_start;
+        hq_output_span( info, out, in, fade_start, frames - fade_start, 0.f, slope, ramp );
+    }
+}
+
+// frames of in up to the silence it ends with, all of them if it ends in sound
+static int hq_sound_frames (hq_info_t *info, const void *in, int frames) {
+    if ( info->rs ) {
+        return min( frames, info->rs->out_sound );
+    }
+    const short *samples = (const short *) in;
+    while ( frames > 0 && !( samples[ frames * 2 - 1 ] | samples[ frames * 2 - 2 ] ) ) frames--;
+    return frames;
+}
+
+static short * hq_scratch (hq_info_t *info, uint32_t frames) {
+    if ( (uint32_t) info->scratch_frames < frames ) {
+        short * scratch = realloc( info->scratch, frames * 2 * sizeof(short) );
+        if ( !scratch ) return NULL;
+        info->scratch = scratch;
+        info->scratch_frames = frames;
+    }
+    return info->scratch;
+}
+
+// next count core frames from the PCM cache, the worker's ring, the block buffer or straight
+// from the emulator
+static int hq_pull (hq_info_t *info, short *samples, uint32_t *count) {
+    if ( info->pcm ) {
+        uint32_t n = min( *count, (uint32_t)( info->pcm_frames - info->pcm_pos ) );
+        if ( !n ) {
+            return -1;
+        }
+        if ( samples ) {
+            memcpy( samples, info->pcm + info->pcm_pos * 2, n * 2 * sizeof(short) );
+        }
+        info->pcm_pos += n;
+        *count = n;
+        return 0;
+    }
+    if ( info->ahead_tid ) {
+        int got = hq_ahead_read( info, samples, *count );
+        if ( got < 0 ) {
+            return -1;
+        }
+        *count = got;
+        return 0;
+    }
+    if ( !info->block ) {
+        return hq_render( info, samples, count );
+    }
+
+    uint32_t done = 0;
+    while ( done < *count ) {
+        if ( info->block_pos == info->block_fill ) {
+            uint32_t block_count = info->block_frames;
+            if ( hq_render( info, info->block, &block_count ) < 0 ) {
+                if ( done ) break;
+                return -1;
+            }
+            info->block_pos = 0;
+            info->block_fill = block_count;
+            if ( !block_count ) break;
+        }
+        uint32_t n = min( *count - done, (uint32_t)( info->block_fill - info->block_pos ) );
+        if ( samples ) {
+            memcpy( samples + done * 2, info->block + info->block_pos * 2, n * 2 * sizeof(short) );
+        }
+        info->block_pos += n;
+        done += n;
+    }
+    *count = done;
+    return 0;
+}
+
+#define RS_CHUNK 4096
+
+// feed the resampler the core frames it needs for count output frames, then run it
+static int hq_resample (hq_info_t *info, uint32_t count) {
+    hq_resampler_t *rs = info->rs;
+    int64_t need = rs_core_needed( rs, info->samples_played + count );
+
+    while ( rs->history_pos + rs->history_count < need ) {
+        uint32_t chunk = min( need - ( rs->history_pos + rs->history_count ), RS_CHUNK );
+        short *samples = hq_scratch( info, chunk );
+        if ( !samples || rs_reserve( rs, info->samples_played, chunk ) < 0 ) {
+            return -1;
+        }
+        if ( hq_pull( info, samples, &chunk ) < 0 ) {
+            return -1;
+        }
+        rs_append( rs, samples, chunk );
+    }
+
+    return rs_process( rs, info->samples_played, count );
+}
+
+static int
+hq_decode (DB_fileinfo_t *_info, char *bytes, int size) {
+    hq_info_t *info = (hq_info_t *)_info;
+    int frame_size = info->output_float ? 2 * sizeof(float) : 2 * sizeof(short);
+    short * samples = (short *) bytes;
+    uint32_t sample_count = size / frame_size;
+    int samples_length = info->samples_to_play + info->samples_to_fade;
+
+    if ( info->samples_played >= samples_length ) {
+        return -1;
+    }
+
+    const void * source = samples;
+    if ( info->rs ) {
+        if ( sample_count > (uint32_t)( samples_length - info->samples_played ) ) sample_count = samples_length - info->samples_played;
+        if ( hq_resample( info, sample_count ) < 0 ) {
+            return -1;
+        }
+        source = info->rs->out;
+    }
+    else {
+        if ( info->output_float && samples ) {
+            samples = hq_scratch( info, sample_count );
+            if ( !samples ) return -1;
+            source = samples;
+        }
+        if ( hq_pull( info, samples, &sample_count ) < 0 ) {
+            return -1;
+        }
+    }
+
+    int samples_start = info->samples_played;
     int samples_end   = info->samples_played += sample_count;
 
-    if ( samples && ( samples_end > info->samples_to_play ) )
-    {
-        int fade_start = info->samples_to_play;
-        if ( fade_start < samples_start ) fade_start = samples_start;
-        int samples_length = info->samples_to_play + info->samples_to_fade;
-        int fade_end = samples_length;
-        if ( fade_end > samples_end ) fade_end = samples_end;
+    if ( samples_end > samples_length ) samples_end = samples_length;
+
+    if ( bytes ) {
+        // silence needs no gain or conversion, only zeros
+        int frames = samples_end - samples_start;
+        int sound = hq_sound_frames( info, source, frames );
+        hq_output( info, bytes, source, samples_start, sound );
+        if ( source != bytes ) {
+            memset( bytes + sound * frame_size, 0, ( frames - sound ) * frame_size );
+        }
+        HQ_STAT( info->stats.frames_silent += frames - sound; )
+    }
+
+    if ( info->preload_at && samples_end >= info->preload_at ) {
+        info->preload_at = 0;
+        preload_next( info, _info->fmt.samplerate );
+    }
+
+    return ( samples_end - samples_start ) * frame_size;
+}
+
+int
+hq_read (DB_fileinfo_t *_info, char *bytes, int size) {
+#ifdef HQ_STATS
+    hq_info_t *info = (hq_info_t *)_info;
+    uint64_t start = hq_stats_now();
+    int rd = hq_decode( _info, bytes, size );
+    hq_stats_read( info, hq_stats_now() - start, rd > 0 ? rd / ( info->output_float ? 2 * sizeof(float) : 2 * sizeof(short) ) : 0 );
+    if ( info->stats_log_frames && info->stats.frames_output >= info->stats_next_log ) {
+        hq_stats_log( info, "progress" );
+        info->stats_next_log = info->stats.frames_output + info->stats_log_frames;
+    }
+    return rd;
+#else
+    return hq_decode( _info, bytes, size );
+#endif
+}
+
+static int
+hq_seek_to (DB_fileinfo_t *_info, int sample) {
+    hq_info_t *info = (hq_info_t *)_info;
+    unsigned long int s = sample;
+
+    int ahead = info->ahead_tid != 0;
+    if ( ahead && !info->rs ) {
+        // targets already sitting in the ring only need the read position moved
+        unsigned avail = __atomic_load_n( &info->ring_write, __ATOMIC_ACQUIRE ) - info->ring_read;
+        if ( s >= (unsigned long) info->samples_played && s - info->samples_played <= avail ) {
+            if ( s > (unsigned long) info->samples_played ) hq_ahead_read( info, NULL, s - info->samples_played );
+            info->samples_played = s;
+            _info->readpos = s/(float)_info->fmt.samplerate;
+            return 0;
+        }
+    }
+    if ( ahead ) {
+        hq_ahead_stop( info );
+    }
+    else if ( !info->rs && s >= (unsigned long) info->samples_played &&
+              s - info->samples_played <= (unsigned long)( info->block_fill - info->block_pos ) ) {
+        // the same for the rest of the current block
+        info->block_pos += s - info->samples_played;
+        info->samples_played = s;
+        _info->readpos = s/(float)_info->fmt.samplerate;
+        return 0;
+    }
+
+    info->block_pos = info->block_fill = 0;
+
+    // the emulator seeks in core frames, far enough back to refill the resampler
+    int target = s;
+    if ( info->rs ) {
+        target = rs_reset( info->rs, s );
+    }
+
+    // the cache may have been finished in the background since the track started
+    if ( info->pcm_key && !info->pcm ) {
+        pcm_attach( info );
+    }
+    if ( info->pcm ) {
+        if ( target > info->pcm_frames ) {
+            return -1;
+        }
+        info->pcm_pos = target;
+        info->samples_played = s;
+        _info->readpos = s/(float)_info->fmt.samplerate;
+        return 0;
+    }
+
+    // restore the closest snapshot before the target, if it beats rendering from here
+    int i = info->snapshot_count;
+    while ( i > 0 && info->snapshots[ i - 1 ].position > target ) i--;
+    if ( i > 0 && ( target < info->emu_position || info->snapshots[ i - 1 ].position > info->emu_position ) ) {
+        memcpy( info->emu, info->snapshots[ i - 1 ].state, qsound_get_state_size() );
+        info->emu_position = info->snapshots[ i - 1 ].position;
+    }
+    else if (target < info->emu_position) {
+        memcpy( info->emu, info->emu_template, qsound_get_state_size() );
+        info->emu_position = 0;
+        HQ_STAT( info->stats.seek_resets++; )
+    }
+    int err = info->emu_position < target && hq_skip( info, target - info->emu_position ) < 0;
+    info->samples_played = s;
+    if ( ahead ) {
+        hq_ahead_start( info );
+    }
+    if ( err ) {
+        return -1;
+    }
+    _info->readpos = s/(float)_info->fmt.samplerate;
+    return 0;
+}
+
+int
+hq_seek_sample (DB_fileinfo_t *_info, int sample) {
+#ifdef HQ_STATS
+    hq_info_t *info = (hq_info_t *)_info;
+    uint64_t start = hq_stats_now();
+    int err = hq_seek_to( _info, sample );
+    info->stats.seek_ns += hq_stats_now() - start;
+    info->stats.seeks++;
+    return err;
+#else
+    return hq_seek_to( _info, sample );
+#endif
+}
+
+int
+hq_seek (DB_fileinfo_t *_info, float time) {
+    return hq_seek_sample (_info, time * _info->fmt.samplerate);
+}
+
+// charset of a file's tags, detected once over all names and values together;
+// NULL when they need no conversion
+static const char *
+tags_charset (const char *tags, uint32_t size) {
+    char sample[4096];
+    uint32_t i, n = min (size, sizeof (sample) - 1);
+    for (i = 0; i < n; i++) {
+        sample[i] = tags[i] ? tags[i] : ' ';
+    }
+    sample[n] = 0;
+    return deadbeef->junk_detect_charset (sample);
+}
+
+static const char *
+convstr (const char* str, const char *cs, char *out, int out_sz) {
+    int i;
+    for (i = 0; str[i] == ' '; i++);
+    if (!str[i]) {
+        out[0] = 0;
+        return out;
+    }
+
+    if (!cs) {
+        return str;
+    }
+    out[out_sz - 1] = 0;
+    if (deadbeef->junk_iconv (str, strlen (str), out, out_sz - 1, cs, "utf-8") >= 0) {
+        return out;
+    }
+
+    trace ("hq: failed to convert tag from %s\n", cs);
+    return str;
+}
+
+// what hq_insert needs from a file, kept in an index that persists between sessions
+struct hq_meta
+{
+    struct hq_meta * next;
+
+    char * path;
+    time_t mtime;
+    off_t size;
+
+    int pending;        // META_QUEUED or META_PARSING while the prescan owns it
+    int is_qsf;
+
+    int tag_song_ms;
+    int tag_fade_ms;
+    int utf8;
+
+    // found by length detection when the file has no length tag
+    int detected_song_ms;
+    int detected_fade_ms;
+
+    // name and value strings, back to back, in the order they go to the playlist
+    int tag_count;
+    uint32_t tags_size;
+    char * tags;
+};
+
+#define META_BUCKETS 4096
+#define META_MAGIC "HQMI"
+#define META_VERSION 2
+
+enum { META_QUEUED = 1, META_PARSING };
+
+static uintptr_t meta_mutex;
+static uintptr_t meta_cond;
+static struct hq_meta * meta_table[ META_BUCKETS ];
+static int meta_loaded;
+static int meta_dirty;
+
+// directories whose siblings were already handed to the scan pool
+struct meta_dir
+{
+    struct meta_dir * next;
+    char * path;
+};
+
+static struct meta_dir * meta_dirs;
+
+static unsigned meta_hash( const char * path )
+{
+    unsigned h = 2166136261u;
+    while ( *path ) h = ( h ^ (unsigned char) *path++ ) * 16777619u;
+    return h % META_BUCKETS;
+}
+
+static void meta_free( struct hq_meta * meta )
+{
+    free( meta->path );
+    if ( meta->tags ) free( meta->tags );
+    free( meta );
+}
+
+static struct hq_meta * meta_find( const char * path )
+{
+    struct hq_meta * meta;
+    for ( meta = meta_table[ meta_hash( path ) ]; meta; meta = meta->next ) {
+        if ( !strcmp( meta->path, path ) ) return meta;
+    }
+    return NULL;
+}
+
+// replaces any entry for the same path
+static void meta_insert( struct hq_meta * meta )
+{
+    struct hq_meta ** prev = &meta_table[ meta_hash( meta->path ) ];
+    struct hq_meta * it;
+    for ( ; ( it = *prev ); prev = &it->next ) {
+        if ( !strcmp( it->path, meta->path ) ) {
+            *prev = it->next;
+            meta_free( it );
+            break;
+        }
+    }
+    meta->next = meta_table[ meta_hash( meta->path ) ];
+    meta_table[ meta_hash( meta->path ) ] = meta;
+}
+
+static void meta_index_path( char * out, size_t size )
+{
+    snprintf( out, size, "%s/hq_meta.idx", deadbeef->get_config_dir() );
+}
+
+static void meta_load( void )
+{
+    char path[PATH_MAX];
+    meta_index_path( path, sizeof( path ) );
 
-        for ( int i = fade_start; i < fade_end; i++ )
-        {
-            samples[ ( i - samples_start ) * 2 + 0 ] = (int64_t)samples[ ( i - samples_start ) * 2 + 0 ] * ( samples_length - i ) / info->samples_to_fade;
-            samples[ ( i - samples_start ) * 2 + 1 ] = (int64_t)samples[ ( i - samples_start ) * 2 + 1 ] * ( samples_length - i ) / info->samples_to_fade;
-        }
+    FILE * f = fopen( path, "rb" );
+    if ( !f ) return;
+
+    char magic[4];
+    uint32_t version;
+    if ( fread( magic, 4, 1, f ) != 1 || memcmp( magic, META_MAGIC, 4 ) ||
+         fread( &version, sizeof( version ), 1, f ) != 1 || version != META_VERSION ) {
+        fclose( f );
+        return;
+    }
 
-        if ( samples_end > samples_length ) samples_end = samples_length;
+    for (;;) {
+        uint32_t path_size;
+        int64_t mtime, size;
+        int32_t fields[7];
+        uint32_t tags_size;
+        if ( fread( &path_size, sizeof( path_size ), 1, f ) != 1 || path_size >= PATH_MAX ) break;
+        struct hq_meta * meta = calloc( 1, sizeof( struct hq_meta ) );
+        if ( !meta ) break;
+        meta->path = malloc( path_size + 1 );
+        if ( !meta->path || fread( meta->path, 1, path_size, f ) != path_size ||
+             fread( &mtime, sizeof( mtime ), 1, f ) != 1 || fread( &size, sizeof( size ), 1, f ) != 1 ||
+             fread( fields, sizeof( fields ), 1, f ) != 1 || fread( &tags_size, sizeof( tags_size ), 1, f ) != 1 ||
+             tags_size > 0x100000 ) {
+            if ( meta->path ) free( meta->path );
+            free( meta );
+            break;
+        }
+        meta->path[ path_size ] = 0;
+        meta->mtime = mtime;
+        meta->size = size;
+        meta->is_qsf = fields[0];
+        meta->tag_song_ms = fields[1];
+        meta->tag_fade_ms = fields[2];
+        meta->utf8 = fields[3];
+        meta->tag_count = fields[4];
+        meta->detected_song_ms = fields[5];
+        meta->detected_fade_ms = fields[6];
+        meta->tags_size = tags_size;
+        if ( tags_size ) {
+            meta->tags = malloc( tags_size );
+            if ( !meta->tags || fread( meta->tags, 1, tags_size, f ) != tags_size || meta->tags[ tags_size - 1 ] ) {
+                meta_free( meta );
+                break;
+            }
+        }
+        meta_insert( meta );
     }
 
-    return ( samples_end - samples_start ) * 2 * sizeof(short);
+    fclose( f );
 }
 
-int
-hq_seek_sample (DB_fileinfo_t *_info, int sample) {
-    hq_info_t *info = (hq_info_t *)_info;
-    unsigned long int s = sample;
-    if (s < info->samples_played) {
+static void meta_save( void )
+{
+    char path[PATH_MAX], temp[PATH_MAX];
+    meta_index_path( path, sizeof( path ) );
+    if ( snprintf( temp, sizeof( temp ), "%s.part", path ) >= (int) sizeof( temp ) ) return;
 
-        qsound_clear_state( info->emu );
+    FILE * f = fopen( temp, "wb" );
+    if ( !f ) return;
 
-        if(info->key_size == 11) {
-            uint8_t * ptr = info->key;
-            uint32_t swap_key1 = get_be32( ptr +  0 );
-            uint32_t swap_key2 = get_be32( ptr +  4 );
-            uint32_t addr_key  = get_be16( ptr +  8 );
-            uint8_t  xor_key   =        *( ptr + 10 );
-            qsound_set_kabuki_key( info->emu, swap_key1, swap_key2, addr_key, xor_key );
-        } else {
-            qsound_set_kabuki_key( info->emu, 0, 0, 0, 0 );
+    uint32_t version = META_VERSION;
+    int ok = fwrite( META_MAGIC, 4, 1, f ) == 1 && fwrite( &version, sizeof( version ), 1, f ) == 1;
+
+    int i;
+    for ( i = 0; ok && i < META_BUCKETS; i++ ) {
+        struct hq_meta * meta;
+        for ( meta = meta_table[ i ]; ok && meta; meta = meta->next ) {
+            if ( meta->pending || meta->is_qsf < 0 ) continue;
+            uint32_t path_size = strlen( meta->path );
+            int64_t mtime = meta->mtime, size = meta->size;
+            int32_t fields[7] = { meta->is_qsf, meta->tag_song_ms, meta->tag_fade_ms, meta->utf8, meta->tag_count,
+                                  meta->detected_song_ms, meta->detected_fade_ms };
+            ok = fwrite( &path_size, sizeof( path_size ), 1, f ) == 1 &&
+                 fwrite( meta->path, 1, path_size, f ) == path_size &&
+                 fwrite( &mtime, sizeof( mtime ), 1, f ) == 1 &&
+                 fwrite( &size, sizeof( size ), 1, f ) == 1 &&
+                 fwrite( fields, sizeof( fields ), 1, f ) == 1 &&
+                 fwrite( &meta->tags_size, sizeof( meta->tags_size ), 1, f ) == 1 &&
+                 fwrite( meta->tags, 1, meta->tags_size, f ) == meta->tags_size;
         }
-        qsound_set_z80_rom( info->emu, info->z80, info->z80_size );
-        qsound_set_sample_rom( info->emu, info->samples, info->samples_size );
+    }
 
-        info->samples_played = 0;
+    if ( fclose( f ) || !ok || rename( temp, path ) ) {
+        unlink( temp );
     }
-    while ( info->samples_played < s ) {
-        int to_skip = s - info->samples_played;
-        if ( to_skip > 32768 ) to_skip = 1024;
-        if ( hq_read( _info, NULL, to_skip * 2 * sizeof(short) ) < 0 ) {
-            return -1;
+}
+
+// read the tags of one file into a fresh entry
+static void meta_parse( struct hq_meta * meta )
+{
+    struct psf_load_state state;
+    memset( &state, 0, sizeof(state) );
+
+    meta->is_qsf = psf_load( meta->path, &psf_file_system, 0, 0, 0, psf_info_dump, &state ) == 0x41;
+    meta->tag_song_ms = state.tag_song_ms;
+    meta->tag_fade_ms = state.tag_fade_ms;
+    meta->utf8 = state.utf8;
+
+    // the entry takes over the tag buffer as it is
+    if ( meta->is_qsf && state.tag_count ) {
+        meta->tags = state.tags;
+        meta->tags_size = state.tags_size;
+        meta->tag_count = state.tag_count;
+    }
+    else {
+        free( state.tags );
+    }
+}
+
+// parse a queued entry in place; it stays in the table while it is pending. Call with
+// meta_mutex held, it is released during the parse
+static void meta_claim_parse( struct hq_meta * meta )
+{
+    meta->pending = META_PARSING;
+    deadbeef->mutex_unlock( meta_mutex );
+    meta_parse( meta );
+    deadbeef->mutex_lock( meta_mutex );
+    meta->pending = 0;
+    meta_dirty = 1;
+    deadbeef->cond_broadcast( meta_cond );
+}
+
+// prescan jobs carry the path, as meta_get may have parsed the entry already and it
+// could have been replaced by the time the job runs
+static void meta_scan_job( void * ctx )
+{
+    char * path = ( char * ) ctx;
+    deadbeef->mutex_lock( meta_mutex );
+    struct hq_meta * meta = meta_find( path );
+    if ( meta && meta->pending == META_QUEUED ) {
+        meta_claim_parse( meta );
+    }
+    deadbeef->mutex_unlock( meta_mutex );
+    free( path );
+}
+
+static void meta_scan_cancel( void * ctx )
+{
+    char * path = ( char * ) ctx;
+    deadbeef->mutex_lock( meta_mutex );
+    struct hq_meta * meta = meta_find( path );
+    if ( meta && meta->pending == META_QUEUED ) {
+        // never parsed, so neither meta_get nor the saved index may take it as an answer
+        meta->pending = 0;
+        meta->is_qsf = -1;
+        deadbeef->cond_broadcast( meta_cond );
+    }
+    deadbeef->mutex_unlock( meta_mutex );
+    free( path );
+}
+
+static int meta_is_qsf_name( const char * name )
+{
+    const char * ext = strrchr( name, '.' );
+    return ext && ( !strcasecmp( ext, ".qsf" ) || !strcasecmp( ext, ".miniqsf" ) );
+}
+
+// files get added a directory at a time, so queue up the rest of it while the
+// host works through the list; call with meta_mutex held
+static void meta_prescan_dir( const char * fname )
+{
+    const char * sep = strrchr( fname, '/' );
+    if ( !sep ) return;
+
+    struct meta_dir * dir;
+    size_t len = sep - fname;
+    for ( dir = meta_dirs; dir; dir = dir->next ) {
+        if ( strlen( dir->path ) == len && !memcmp( dir->path, fname, len ) ) return;
+    }
+    dir = malloc( sizeof( struct meta_dir ) );
+    if ( !dir || !( dir->path = malloc( len + 1 ) ) ) {
+        if ( dir ) free( dir );
+        return;
+    }
+    memcpy( dir->path, fname, len );
+    dir->path[ len ] = 0;
+    dir->next = meta_dirs;
+    meta_dirs = dir;
+
+    DIR * d = opendir( len ? dir->path : "/" );
+    if ( !d ) return;
+
+    struct dirent * de;
+    char path[PATH_MAX];
+    while ( ( de = readdir( d ) ) ) {
+        if ( !meta_is_qsf_name( de->d_name ) ) continue;
+        snprintf( path, sizeof( path ), "%s/%s", dir->path, de->d_name );
+
+        struct stat st;
+        if ( !strcmp( path, fname ) || stat( path, &st ) < 0 ) continue;
+        struct hq_meta * meta = meta_find( path );
+        if ( meta && ( meta->pending || ( meta->mtime == st.st_mtime && meta->size == st.st_size ) ) ) continue;
+
+        meta = calloc( 1, sizeof( struct hq_meta ) );
+        if ( !meta || !( meta->path = strdup( path ) ) ) {
+            if ( meta ) free( meta );
+            break;
+        }
+        meta->mtime = st.st_mtime;
+        meta->size = st.st_size;
+        meta->pending = META_QUEUED;
+        meta_insert( meta );
+        char * job_path = strdup( path );
+        if ( !job_path || pool_submit( meta_scan_job, meta_scan_cancel, job_path ) < 0 ) {
+            free( job_path );
+            meta->pending = 0;
+            meta->is_qsf = -1;
         }
     }
-    _info->readpos = s/(float)_info->fmt.samplerate;
+    closedir( d );
+}
+
+// copy an entry out of the index, so the caller holds no reference into it
+static int meta_copy( struct hq_meta * out, const struct hq_meta * meta )
+{
+    *out = *meta;
+    out->next = NULL;
+    out->path = NULL;
+    out->tags = NULL;
+    if ( meta->tags_size ) {
+        out->tags = malloc( meta->tags_size );
+        if ( !out->tags ) return -1;
+        memcpy( out->tags, meta->tags, meta->tags_size );
+    }
     return 0;
 }
 
-int
-hq_seek (DB_fileinfo_t *_info, float time) {
-    return hq_seek_sample (_info, time * _info->fmt.samplerate);
+// fill in the index entry for a local file, parsing it if needed; -1 when not indexed
+static int meta_get( const char * fname, struct hq_meta * out )
+{
+    struct stat st;
+    if ( !deadbeef->conf_get_int( "hq.meta_index", 1 ) || stat( fname, &st ) < 0 ) return -1;
+
+    deadbeef->mutex_lock( meta_mutex );
+    if ( !meta_loaded ) {
+        meta_load();
+        meta_loaded = 1;
+    }
+
+    // a prescan that has not started yet is done here rather than waited for, the
+    // pool may be busy with other work
+    struct hq_meta * meta;
+    while ( ( meta = meta_find( fname ) ) && meta->pending ) {
+        if ( meta->pending == META_QUEUED ) {
+            meta_claim_parse( meta );
+        }
+        else {
+            deadbeef->cond_wait( meta_cond, meta_mutex );
+        }
+    }
+    if ( meta && meta->is_qsf >= 0 && meta->mtime == st.st_mtime && meta->size == st.st_size ) {
+        int err = meta_copy( out, meta );
+        deadbeef->mutex_unlock( meta_mutex );
+        return err;
+    }
+
+    if ( deadbeef->conf_get_int( "hq.meta_prescan", 1 ) ) {
+        meta_prescan_dir( fname );
+    }
+    deadbeef->mutex_unlock( meta_mutex );
+
+    meta = calloc( 1, sizeof( struct hq_meta ) );
+    if ( !meta || !( meta->path = strdup( fname ) ) ) {
+        if ( meta ) free( meta );
+        return -1;
+    }
+    meta->mtime = st.st_mtime;
+    meta->size = st.st_size;
+    meta_parse( meta );
+
+    deadbeef->mutex_lock( meta_mutex );
+    int err = meta_copy( out, meta );
+    meta_insert( meta );
+    meta_dirty = 1;
+    deadbeef->mutex_unlock( meta_mutex );
+
+    return err;
 }
 
-static const char *
-convstr (const char* str, int sz, char *out, int out_sz) {
+static void meta_shutdown( void )
+{
+    if ( meta_dirty ) {
+        meta_save();
+        meta_dirty = 0;
+    }
+
     int i;
-    for (i = 0; i < sz; i++) {
-        if (str[i] != ' ') {
-            break;
+    for ( i = 0; i < META_BUCKETS; i++ ) {
+        while ( meta_table[ i ] ) {
+            struct hq_meta * next = meta_table[ i ]->next;
+            meta_free( meta_table[ i ] );
+            meta_table[ i ] = next;
         }
     }
-    if (i == sz) {
-        out[0] = 0;
-        return out;
+    while ( meta_dirs ) {
+        struct meta_dir * next = meta_dirs->next;
+        free( meta_dirs->path );
+        free( meta_dirs );
+        meta_dirs = next;
     }
+    meta_loaded = 0;
+}
 
-    const char *cs = deadbeef->junk_detect_charset (str);
-    if (!cs) {
-        return str;
+// ReplayGain analysis of tracks without gain tags: each track is rendered on the
+// job pool as it would play, with its length and fade, and measured the way
+// ReplayGain 1.0 does, through the equal loudness filter in 50 ms RMS blocks.
+// Tracks sharing a _lib form an album; once the last pending track of the set
+// finishes, album values are set on all of them and the album is let go, so a set
+// added again later is measured afresh
+#define RG_YULE_ORDER 10
+#define RG_STEPS_PER_DB 100
+#define RG_MAX_DB 120
+#define RG_HIST_SIZE ( RG_STEPS_PER_DB * RG_MAX_DB )
+#define RG_PINK_REF 64.82
+#define RG_BLOCK 4096
+
+// filter coefficients for 44100 Hz, b0, a1, b1, a2, b2, ...
+static const double rg_yule[ 2 * RG_YULE_ORDER + 1 ] = {
+    0.05418656406430, -3.47845948550071, -0.02911007808948,  6.36317777566148, -0.00848709379851,
+   -8.54751527471874, -0.00851165645469,  9.47693607801280, -0.00834990904936, -8.81498681370155,
+    0.02245293253339,  6.85401540936998, -0.02596338512915, -4.39470996079559,  0.01624864962975,
+    2.19611684890774, -0.00240879051584, -0.75104302451432,  0.00674613682247,  0.13149317958808,
+   -0.00187763777362
+};
+static const double rg_butter[5] = {
+    0.98500175787242, -1.97222672652489, -1.97000351574484, 0.97261396931306, 0.98500175787242
+};
+
+typedef struct {
+    double yule_in[2][ RG_YULE_ORDER ];
+    double yule_out[2][ RG_YULE_ORDER ];
+    double butter_in[2][2];
+    double butter_out[2][2];
+    double sum;
+    int block_fill;
+    int block_size;
+    float peak;
+    uint32_t hist[ RG_HIST_SIZE ];
+} rg_state_t;
+
+struct rg_album {
+    struct rg_album *next;
+    char *key;
+    uint32_t hist[ RG_HIST_SIZE ];
+    float peak;
+    int pending;
+    DB_playItem_t **items;
+    char **paths;               // of the items, a file added twice counts once
+    int item_count;
+    int item_max;
+};
+
+typedef struct {
+    DB_playItem_t *it;
+    char *path;
+    struct rg_album *album;
+    int counts;                 // adds to the album, not a second item of a file already in it
+} rg_job_t;
+
+static uintptr_t rg_mutex;
+static struct rg_album *rg_albums;
+
+static double rg_filter (const double *k, int order, double *in, double *out, double x) {
+    double y = 1e-10 + k[0] * x;
+    int i;
+    for (i = 0; i < order; i++) {
+        y += k[2 * i + 2] * in[i] - k[2 * i + 1] * out[i];
     }
-    else {
-        if (deadbeef->junk_iconv (str, sz, out, out_sz, cs, "utf-8") >= 0) {
-            return out;
+    memmove (in + 1, in, ( order - 1 ) * sizeof (double));
+    memmove (out + 1, out, ( order - 1 ) * sizeof (double));
+    in[0] = x;
+    out[0] = y;
+    return y;
+}
+
+// samples are interleaved stereo, full scale at 1
+static void rg_analyze (rg_state_t *st, const float *samples, int frames) {
+    int i, c;
+    for (i = 0; i < frames; i++) {
+        for (c = 0; c < 2; c++) {
+            float x = samples[i * 2 + c];
+            if (fabsf (x) > st->peak) st->peak = fabsf (x);
+            double y = rg_filter (rg_yule, RG_YULE_ORDER, st->yule_in[c], st->yule_out[c], x * 32768.);
+            y = rg_filter (rg_butter, 2, st->butter_in[c], st->butter_out[c], y);
+            st->sum += y * y;
+        }
+        if (++st->block_fill == st->block_size) {
+            double db = 10. * log10 (st->sum / st->block_size * 0.5 + 1e-37);
+            int step = (int)( RG_STEPS_PER_DB * db );
+            if (step < 0) step = 0;
+            if (step >= RG_HIST_SIZE) step = RG_HIST_SIZE - 1;
+            st->hist[step]++;
+            st->sum = 0;
+            st->block_fill = 0;
         }
     }
+}
 
-    trace ("cdumb: failed to detect charset\n");
-    return NULL;
+// the loudness exceeded by the loudest 5% of blocks, as a gain to the reference level
+static float rg_gain (const uint32_t *hist) {
+    uint64_t total = 0, seen = 0;
+    int i;
+    for (i = 0; i < RG_HIST_SIZE; i++) {
+        total += hist[i];
+    }
+    if (!total) {
+        return 0.f;
+    }
+    uint64_t upper = (uint64_t)ceil (total * 0.05);
+    for (i = RG_HIST_SIZE; i-- > 0; ) {
+        if ((seen += hist[i]) >= upper) break;
+    }
+    if (i < 0) i = 0;
+    return (float)( RG_PINK_REF - (double)i / RG_STEPS_PER_DB );
+}
+
+static void rg_job_free (rg_job_t *job) {
+    deadbeef->pl_item_unref (job->it);
+    free (job->path);
+    free (job);
+}
+
+static void rg_album_free (struct rg_album *album) {
+    int i;
+    for (i = 0; i < album->item_count; i++) {
+        deadbeef->pl_item_unref (album->items[i]);
+        free (album->paths[i]);
+    }
+    free (album->items);
+    free (album->paths);
+    free (album->key);
+    free (album);
+}
+
+// a track is done or abandoned, publish the album once the set has nothing pending
+static void rg_album_finish (struct rg_album *album, const rg_state_t *st) {
+    int i;
+    deadbeef->mutex_lock (rg_mutex);
+    if (st) {
+        for (i = 0; i < RG_HIST_SIZE; i++) {
+            album->hist[i] += st->hist[i];
+        }
+        if (st->peak > album->peak) album->peak = st->peak;
+    }
+    if (--album->pending) {
+        deadbeef->mutex_unlock (rg_mutex);
+        return;
+    }
+    // nothing can join it any more, its items' refs go with it
+    struct rg_album **prev;
+    for (prev = &rg_albums; *prev != album; prev = &( *prev )->next);
+    *prev = album->next;
+    deadbeef->mutex_unlock (rg_mutex);
+
+    float gain = rg_gain (album->hist);
+    for (i = 0; i < album->item_count; i++) {
+        deadbeef->pl_set_item_replaygain (album->items[i], DDB_REPLAYGAIN_ALBUMGAIN, gain);
+        deadbeef->pl_set_item_replaygain (album->items[i], DDB_REPLAYGAIN_ALBUMPEAK, album->peak);
+    }
+    rg_album_free (album);
+}
+
+static void rg_job_cancel (void *ctx) {
+    rg_job_t *job = (rg_job_t *)ctx;
+    rg_album_finish (job->album, NULL);
+    rg_job_free (job);
+}
+
+static void rg_job_run (void *ctx) {
+    rg_job_t *job = (rg_job_t *)ctx;
+    hq_info_t *info = (hq_info_t *)hq_open (0);
+    rg_state_t *st = calloc (1, sizeof (rg_state_t));
+    float *buffer = malloc (RG_BLOCK * 2 * sizeof (float));
+    int done = 0;
+
+    if (info && st && buffer && hq_load_track (info, job->path, job->it, HQ_CORE_RATE) == 0) {
+        // plain float output at the core rate, nothing else from hq_init applies
+        info->gain = 1.f;
+        info->output_float = 1;
+        info->info.fmt.samplerate = HQ_CORE_RATE;
+        st->block_size = HQ_CORE_RATE / 20;
+
+        int rd;
+        while (!pool_stopping () && ( rd = hq_read (&info->info, (char *)buffer, RG_BLOCK * 2 * sizeof (float)) ) > 0) {
+            rg_analyze (st, buffer, rd / ( 2 * sizeof (float) ));
+        }
+        done = !pool_stopping ();
+    }
+
+    if (done) {
+        deadbeef->pl_set_item_replaygain (job->it, DDB_REPLAYGAIN_TRACKGAIN, rg_gain (st->hist));
+        deadbeef->pl_set_item_replaygain (job->it, DDB_REPLAYGAIN_TRACKPEAK, st->peak);
+    }
+    rg_album_finish (job->album, done && job->counts ? st : NULL);
+
+    if (info) hq_free (&info->info);
+    if (st) free (st);
+    if (buffer) free (buffer);
+    rg_job_free (job);
+}
+
+static void rg_queue (DB_playItem_t *it, const char *fname) {
+    // the set is what the track's _lib points at, tracks without one go by directory
+    char lib[PATH_MAX], key[PATH_MAX];
+    if (qsf_read_lib (fname, lib) < 0) {
+        return;
+    }
+    rom_lib_path (key, fname, lib);
+
+    rg_job_t *job = malloc (sizeof (rg_job_t));
+    if (!job || !(job->path = strdup (fname))) {
+        if (job) free (job);
+        return;
+    }
+    job->it = it;
+    deadbeef->pl_item_ref (it);
+
+    deadbeef->mutex_lock (rg_mutex);
+    struct rg_album *album;
+    for (album = rg_albums; album; album = album->next) {
+        if (!strcmp (album->key, key)) break;
+    }
+    if (!album && ( album = calloc (1, sizeof (struct rg_album)) )) {
+        if (( album->key = strdup (key) )) {
+            album->next = rg_albums;
+            rg_albums = album;
+        }
+        else {
+            free (album);
+            album = NULL;
+        }
+    }
+    if (album && album->item_count == album->item_max) {
+        int max = album->item_max ? album->item_max * 2 : 16;
+        DB_playItem_t **items = realloc (album->items, max * sizeof (DB_playItem_t *));
+        if (items) {
+            album->items = items;
+        }
+        char **paths = realloc (album->paths, max * sizeof (char *));
+        if (paths) {
+            album->paths = paths;
+        }
+        if (items && paths) {
+            album->item_max = max;
+        }
+    }
+    char *path = album && album->item_count < album->item_max ? strdup (fname) : NULL;
+    if (!path) {
+        deadbeef->mutex_unlock (rg_mutex);
+        rg_job_free (job);
+        return;
+    }
+    int i;
+    job->counts = 1;
+    for (i = 0; i < album->item_count; i++) {
+        if (!strcmp (album->paths[i], path)) job->counts = 0;
+    }
+    album->items[album->item_count] = it;
+    album->paths[album->item_count++] = path;
+    deadbeef->pl_item_ref (it);
+    album->pending++;
+    job->album = album;
+    deadbeef->mutex_unlock (rg_mutex);
+
+    if (pool_submit_slow (rg_job_run, rg_job_cancel, job) < 0) {
+        rg_job_cancel (job);
+    }
+}
+
+// after the pool has stopped, so no job still refers to an album
+static void rg_shutdown (void) {
+    while (rg_albums) {
+        struct rg_album *next = rg_albums->next;
+        rg_album_free (rg_albums);
+        rg_albums = next;
+    }
+}
+
+// length detection for files without a length tag: render the track without
+// output, stopping at a long enough stretch of silence or at a loop. An exact
+// repeat of the emulator state at a block boundary is a certain loop but only
+// shows up when the loop is a whole number of blocks long, so the output is also
+// searched for repeats at any offset (see detect_loop_feed); that search is best
+// effort and can take a long exactly repeated phrase for the loop
+#define DETECT_BLOCK 4096
+#define DETECT_SILENCE_LEVEL 8
+#define DETECT_MAX_HASHES 65536
+
+// output loops: a rolling hash over the last DETECT_WINDOW frames marks the window
+// ends where its top bits are zero, about one frame in 2048. Those anchors depend on
+// the audio alone, so when the music repeats with period P every anchor of the
+// repeat has a twin with the same hash exactly P frames earlier. A candidate period
+// counts once its anchors have matched for a whole period
+#define DETECT_WINDOW 1024
+#define DETECT_ANCHOR_SHIFT 53
+#define DETECT_MAX_ANCHORS 65536
+#define DETECT_INDEX_SIZE ( DETECT_MAX_ANCHORS * 2 )
+#define DETECT_HASH_BASE 0x100000001b3ULL
+// seconds; shorter exact repeats are more likely held notes than loops
+#define DETECT_MIN_LOOP 5
+
+typedef struct {
+    uint64_t hash;
+    int pos;
+    int prev;           // the previous anchor with the same hash, -1 if none
+} detect_anchor_t;
+
+typedef struct {
+    uint32_t ring[DETECT_WINDOW];
+    uint64_t hash;
+    uint64_t base_pow;  // DETECT_HASH_BASE to the power DETECT_WINDOW
+    int pos;            // frames seen
+    int last_sound;
+    detect_anchor_t *anchors;
+    int anchor_count;
+    int *index;         // latest anchor for a hash, open addressing
+    int min_period;
+    int period;         // candidate loop length, 0 while there is none
+    int run_start;      // anchor where the candidate's matches began
+} detect_loop_t;
+
+static int detect_loop_init (detect_loop_t *dl, int min_period) {
+    memset (dl, 0, sizeof (detect_loop_t));
+    dl->anchors = malloc (DETECT_MAX_ANCHORS * sizeof (detect_anchor_t));
+    dl->index = malloc (DETECT_INDEX_SIZE * sizeof (int));
+    if (!dl->anchors || !dl->index) {
+        free (dl->anchors);
+        free (dl->index);
+        return -1;
+    }
+    memset (dl->index, 0xff, DETECT_INDEX_SIZE * sizeof (int));
+    dl->base_pow = 1;
+    int i;
+    for (i = 0; i < DETECT_WINDOW; i++) dl->base_pow *= DETECT_HASH_BASE;
+    dl->last_sound = -DETECT_WINDOW;
+    dl->min_period = min_period;
+    return 0;
+}
+
+static void detect_loop_free (detect_loop_t *dl) {
+    free (dl->anchors);
+    free (dl->index);
+}
+
+static int *detect_loop_slot (detect_loop_t *dl, uint64_t hash) {
+    unsigned i = (unsigned)( hash ^ ( hash >> 32 ) ) & ( DETECT_INDEX_SIZE - 1 );
+    while (dl->index[i] >= 0 && dl->anchors[dl->index[i]].hash != hash) {
+        i = ( i + 1 ) & ( DETECT_INDEX_SIZE - 1 );
+    }
+    return &dl->index[i];
+}
+
+static int detect_loop_has (detect_loop_t *dl, uint64_t hash, int pos) {
+    int k;
+    for (k = *detect_loop_slot (dl, hash); k >= 0 && dl->anchors[k].pos >= pos; k = dl->anchors[k].prev) {
+        if (dl->anchors[k].pos == pos) return 1;
+    }
+    return 0;
+}
+
+// 1 once the output so far ends in a confirmed loop, with where it starts and its length
+static int detect_loop_feed (detect_loop_t *dl, const short *frames, uint32_t count, int *intro, int *period) {
+    uint32_t j;
+    for (j = 0; j < count; j++) {
+        short l = frames[j * 2], r = frames[j * 2 + 1];
+        uint32_t x = (uint32_t)(uint16_t)l << 16 | (uint16_t)r;
+        uint32_t *slot = &dl->ring[dl->pos % DETECT_WINDOW];
+        dl->hash = dl->hash * DETECT_HASH_BASE + x - *slot * dl->base_pow;
+        *slot = x;
+        if (l > DETECT_SILENCE_LEVEL || l < -DETECT_SILENCE_LEVEL || r > DETECT_SILENCE_LEVEL || r < -DETECT_SILENCE_LEVEL) {
+            dl->last_sound = dl->pos;
+        }
+        int pos = ++dl->pos;
+
+        // silent windows all look alike, and are no loop
+        if (pos < DETECT_WINDOW || pos - dl->last_sound > DETECT_WINDOW || ( dl->hash >> DETECT_ANCHOR_SHIFT )) continue;
+
+        if (dl->period) {
+            if (!detect_loop_has (dl, dl->hash, pos - dl->period)) {
+                dl->period = 0;
+            }
+            else if (pos - dl->run_start >= dl->period) {
+                *intro = dl->run_start - dl->period;
+                *period = dl->period;
+                return 1;
+            }
+        }
+
+        int *head = detect_loop_slot (dl, dl->hash);
+        if (!dl->period) {
+            int k;
+            for (k = *head; k >= 0; k = dl->anchors[k].prev) {
+                if (pos - dl->anchors[k].pos >= dl->min_period) {
+                    dl->period = pos - dl->anchors[k].pos;
+                    dl->run_start = pos;
+                    break;
+                }
+            }
+        }
+
+        if (dl->anchor_count < DETECT_MAX_ANCHORS) {
+            detect_anchor_t *a = &dl->anchors[dl->anchor_count];
+            a->hash = dl->hash;
+            a->pos = pos;
+            a->prev = *head;
+            *head = dl->anchor_count++;
+        }
+    }
+    return 0;
+}
+
+typedef struct {
+    DB_playItem_t *it;
+    ddb_playlist_t *plt;
+    char *path;
+    // queue a ReplayGain scan once the length is known
+    int replaygain;
+} detect_job_t;
+
+static uint64_t detect_hash (const void *data, size_t size) {
+    const uint8_t *p = data;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    while (size--) h = ( h ^ *p++ ) * 0x100000001b3ULL;
+    return h;
+}
+
+// on success, fills in the song length and fade in ms
+static int detect_length (hq_info_t *info, int *song_ms, int *fade_ms) {
+    const int srate = HQ_CORE_RATE;
+    int max_frames = deadbeef->conf_get_int ("hq.detect_length_max", 600) * srate;
+    int silence_frames = deadbeef->conf_get_int ("hq.detect_silence", 5) * srate;
+    int loops = deadbeef->conf_get_int ("hq.detect_loops", 2);
+    if (silence_frames < DETECT_BLOCK) silence_frames = DETECT_BLOCK;
+    if (loops < 1) loops = 1;
+
+    short *buffer = malloc (DETECT_BLOCK * 2 * sizeof(short));
+    uint64_t *hashes = malloc (DETECT_MAX_HASHES * sizeof(uint64_t));
+    detect_loop_t dl;
+    if (!buffer || !hashes || detect_loop_init (&dl, DETECT_MIN_LOOP * srate) < 0) {
+        if (buffer) free (buffer);
+        if (hashes) free (hashes);
+        return -1;
+    }
+
+    int hash_count = 0;
+    int last_sound = -1;
+    int result = -1;
+
+    while (info->emu_position < max_frames && !pool_stopping ()) {
+        // state at each block boundary, a repeat means the rest plays out the same
+        if (hash_count < DETECT_MAX_HASHES) {
+            uint64_t h = detect_hash (info->emu, qsound_get_state_size());
+            int i;
+            for (i = 0; i < hash_count; i++) {
+                if (hashes[i] == h) break;
+            }
+            if (i < hash_count) {
+                int intro = i * DETECT_BLOCK;
+                int period = hash_count * DETECT_BLOCK - intro;
+                *song_ms = (int64_t)( intro + period * loops ) * 1000 / srate;
+                *fade_ms = DEFAULT_FADE_MS;
+                result = 0;
+                break;
+            }
+            hashes[hash_count++] = h;
+        }
+
+        uint32_t count = DETECT_BLOCK;
+        int start = info->emu_position;
+        if (hq_render (info, buffer, &count) < 0) break;
+
+        uint32_t i;
+        for (i = 0; i < count * 2; i++) {
+            if (buffer[i] > DETECT_SILENCE_LEVEL || buffer[i] < -DETECT_SILENCE_LEVEL) {
+                last_sound = start + i / 2;
+            }
+        }
+
+        if (last_sound >= 0 && info->emu_position - last_sound >= silence_frames) {
+            *song_ms = (int64_t)( last_sound + 1 ) * 1000 / srate + 1;
+            *fade_ms = 0;
+            result = 0;
+            break;
+        }
+
+        int intro, period;
+        if (detect_loop_feed (&dl, buffer, count, &intro, &period)) {
+            *song_ms = (int64_t)( intro + (int64_t)period * loops ) * 1000 / srate;
+            *fade_ms = DEFAULT_FADE_MS;
+            result = 0;
+            break;
+        }
+    }
+
+    detect_loop_free (&dl);
+    free (buffer);
+    free (hashes);
+    return result;
+}
+
+static void detect_job_free (detect_job_t *job) {
+    deadbeef->pl_item_unref (job->it);
+    if (job->plt) deadbeef->plt_unref (job->plt);
+    free (job->path);
+    free (job);
+}
+
+static void detect_job_cancel (void *ctx) {
+    detect_job_free ((detect_job_t *)ctx);
+}
+
+static void detect_job_run (void *ctx) {
+    detect_job_t *job = (detect_job_t *)ctx;
+    hq_info_t *info = calloc (1, sizeof (hq_info_t));
+    int song_ms, fade_ms;
+
+    if (info && hq_load_track (info, job->path, NULL, HQ_CORE_RATE) == 0 && detect_length (info, &song_ms, &fade_ms) == 0) {
+        char value[16];
+        snprintf (value, sizeof (value), "%d", song_ms);
+        deadbeef->pl_replace_meta (job->it, ":HQ_DETECTED_LENGTH", value);
+        snprintf (value, sizeof (value), "%d", fade_ms);
+        deadbeef->pl_replace_meta (job->it, ":HQ_DETECTED_FADE", value);
+        deadbeef->plt_set_item_duration (job->plt, job->it, (float)(song_ms + fade_ms) / 1000.f);
+
+        deadbeef->mutex_lock (meta_mutex);
+        struct hq_meta *meta = meta_find (job->path);
+        if (meta && !meta->pending) {
+            meta->detected_song_ms = song_ms;
+            meta->detected_fade_ms = fade_ms;
+            meta_dirty = 1;
+        }
+        deadbeef->mutex_unlock (meta_mutex);
+    }
+
+    if (info) hq_free ((DB_fileinfo_t *)info);
+    if (job->replaygain && !pool_stopping ()) {
+        rg_queue (job->it, job->path);
+    }
+    detect_job_free (job);
+}
+
+static void detect_queue (ddb_playlist_t *plt, DB_playItem_t *it, const char *fname, int replaygain) {
+    detect_job_t *job = malloc (sizeof (detect_job_t));
+    if (!job || !(job->path = strdup (fname))) {
+        if (job) free (job);
+        return;
+    }
+    job->it = it;
+    job->plt = plt;
+    job->replaygain = replaygain;
+    deadbeef->pl_item_ref (it);
+    if (plt) deadbeef->plt_ref (plt);
+    if (pool_submit_slow (detect_job_run, detect_job_cancel, job) < 0) {
+        detect_job_free (job);
+    }
 }
 
 DB_playItem_t *
 hq_insert (ddb_playlist_t *plt, DB_playItem_t *after, const char *fname) {
     DB_playItem_t *it = NULL;
 
-    struct psf_load_state state;
-    memset( &state, 0, sizeof(state) );
-
-    int psf_version = psf_load( fname, &psf_file_system, 0, 0, 0, psf_info_dump, &state );
+    struct hq_meta meta;
+    if ( meta_get( fname, &meta ) < 0 ) {
+        memset( &meta, 0, sizeof(meta) );
+        meta.path = (char *) fname;
+        meta_parse( &meta );
+    }
 
-    if ( psf_version < 0 )
+    if ( meta.is_qsf <= 0 ) {
+        if ( meta.tags ) free( meta.tags );
         return after;
+    }
 
-    if ( psf_version != 0x41 )
-        return after;
+    int tag_song_ms = meta.tag_song_ms;
+    int tag_fade_ms = meta.tag_fade_ms;
 
-    int tag_song_ms = state.tag_song_ms;
-    int tag_fade_ms = state.tag_fade_ms;
+    it = deadbeef->pl_item_alloc_init (fname, hq_plugin.plugin.id);
 
-    if (!tag_song_ms)
+    if (!tag_song_ms && meta.detected_song_ms)
     {
-        tag_song_ms = ( 2 * 60 + 50 ) * 1000;
-        tag_fade_ms =            10   * 1000;
+        char value[16];
+        tag_song_ms = meta.detected_song_ms;
+        tag_fade_ms = meta.detected_fade_ms;
+        snprintf (value, sizeof (value), "%d", tag_song_ms);
+        deadbeef->pl_replace_meta (it, ":HQ_DETECTED_LENGTH", value);
+        snprintf (value, sizeof (value), "%d", tag_fade_ms);
+        deadbeef->pl_replace_meta (it, ":HQ_DETECTED_FADE", value);
     }
 
-    it = deadbeef->pl_item_alloc_init (fname, hq_plugin.plugin.id);
+    int detect = !tag_song_ms && deadbeef->conf_get_int ("hq.detect_length", 0);
+    // hq.replaygain_scan measures tracks that come without ReplayGain tags
+    int replaygain = deadbeef->conf_get_int ("hq.replaygain_scan", 0);
+
+    if (!tag_song_ms)
+    {
+        tag_song_ms = DEFAULT_SONG_MS;
+        tag_fade_ms = DEFAULT_FADE_MS;
+    }
 
     char junk_buffer[2][1024];
+    const char * cs = meta.utf8 || !meta.tag_count ? NULL : tags_charset( meta.tags, meta.tags_size );
 
-    struct psf_tag * tag = state.tags;
-    while ( tag ) {
-        if ( !strncasecmp( tag->name, "replaygain_", 11 ) ) {
-            double fval = atof( tag->value );
-            if ( !strcasecmp( tag->name + 11, "album_gain" ) ) {
+    const char * name = meta.tags;
+    int i;
+    for ( i = 0; i < meta.tag_count; i++ ) {
+        const char * value = name + strlen( name ) + 1;
+        if ( !strncasecmp( name, "replaygain_", 11 ) ) {
+            double fval = atof( value );
+            replaygain = 0;
+            if ( !strcasecmp( name + 11, "album_gain" ) ) {
                 deadbeef->pl_set_item_replaygain( it, DDB_REPLAYGAIN_ALBUMGAIN, fval );
-            } else if ( !strcasecmp( tag->name + 11, "album_peak" ) ) {
+            } else if ( !strcasecmp( name + 11, "album_peak" ) ) {
                 deadbeef->pl_set_item_replaygain( it, DDB_REPLAYGAIN_ALBUMPEAK, fval );
-            } else if ( !strcasecmp( tag->name + 11, "track_gain" ) ) {
+            } else if ( !strcasecmp( name + 11, "track_gain" ) ) {
                 deadbeef->pl_set_item_replaygain( it, DDB_REPLAYGAIN_TRACKGAIN, fval );
-            } else if ( !strcasecmp( tag->name + 11, "track_peak" ) ) {
+            } else if ( !strcasecmp( name + 11, "track_peak" ) ) {
                 deadbeef->pl_set_item_replaygain( it, DDB_REPLAYGAIN_TRACKPEAK, fval );
             }
         } else {
-            if ( !state.utf8 ) {
-                junk_buffer[0][ 1023 ] = '\0';
-                junk_buffer[1][ 1023 ] = '\0';
-                deadbeef->pl_add_meta (it, convstr( tag->name, strlen( tag->name ), junk_buffer[0], 1023 ),
-                        convstr( tag->value, strlen( tag->value ), junk_buffer[1], 1023 ));
+            if ( !meta.utf8 ) {
+                deadbeef->pl_add_meta (it, convstr( name, cs, junk_buffer[0], 1024 ),
+                        convstr( value, cs, junk_buffer[1], 1024 ));
             } else {
-                deadbeef->pl_add_meta (it, tag->name, tag->value);
+                deadbeef->pl_add_meta (it, name, value);
             }
         }
-        tag = tag->next;
+        name = value + strlen( value ) + 1;
     }
-    free_tags( state.tags );
+    if ( meta.tags ) free( meta.tags );
 
     deadbeef->plt_set_item_duration (plt, it, (float)(tag_song_ms + tag_fade_ms) / 1000.f);
     deadbeef->pl_add_meta (it, ":FILETYPE", "QSF");
     after = deadbeef->plt_insert_item (plt, after, it);
+    if (detect) {
+        detect_queue (plt, it, fname, replaygain);
+    }
+    else if (replaygain) {
+        rg_queue (it, fname);
+    }
     deadbeef->pl_item_unref (it);
     return after;
 }
@@ -651,11 +4068,31 @@ hq_insert (ddb_playlist_t *plt, DB_playItem_t *after, const char *fname) {
 int
 hq_start (void) {
     qsound_init();
+    hq_kernels_select (deadbeef->conf_get_int ("hq.simd", 1));
+    hq_mutex = deadbeef->mutex_create ();
+    pool_mutex = deadbeef->mutex_create ();
+    pool_cond = deadbeef->cond_create ();
+    meta_mutex = deadbeef->mutex_create ();
+    meta_cond = deadbeef->cond_create ();
+    preload_cond = deadbeef->cond_create ();
+    rg_mutex = deadbeef->mutex_create ();
     return 0;
 }
 
 int
 hq_stop (void) {
+    pool_stop ();
+    rg_shutdown ();
+    deadbeef->mutex_free (rg_mutex);
+    meta_shutdown ();
+    deadbeef->mutex_free (meta_mutex);
+    deadbeef->cond_free (meta_cond);
+    deadbeef->mutex_free (pool_mutex);
+    deadbeef->cond_free (pool_cond);
+    preload_flush ();
+    deadbeef->cond_free (preload_cond);
+    rom_cache_flush ();
+    deadbeef->mutex_free (hq_mutex);
     return 0;
 }
 
@@ -0,0 +1,357 @@
+/*
+    hqrender - render QSF tracks to WAV files, in parallel
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+*/
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hqhost.h"
+
+static void
+usage (void) {
+    fprintf (stderr,
+        "usage: hqrender [options] file-or-directory...\n"
+        "  -d directory   where to write the .wav files (default .)\n"
+        "  -j threads     tracks rendered at once (default: one per CPU)\n"
+        "  -f             write 32-bit float instead of 16-bit PCM\n"
+        "  -s rate        output sample rate, same as -o hq.samplerate=rate\n"
+        "  -o key=value   set a plugin option\n"
+        "tracks are rendered in full, with the length and fade from their tags; each\n"
+        "goes to its path below the argument it was found under, with .wav for its\n"
+        "extension, and existing files are left alone\n");
+    exit (1);
+}
+
+typedef struct {
+    DB_playItem_t *it;
+    const char *root;
+    float duration;
+    double seconds;
+    int failed;
+} render_track_t;
+
+static render_track_t *tracks;
+static int track_count;
+static int next_track;
+static const char *out_dir = ".";
+
+// for every playlist item, the part of its path that is left out under out_dir: the
+// directory given on the command line, or the directory of a file given there
+static const char **item_roots;
+static int item_root_count;
+
+static pthread_mutex_t print_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+has_ext (const char *fname, const char *ext) {
+    size_t len = strlen (fname), ext_len = strlen (ext);
+    return len > ext_len && !strcasecmp (fname + len - ext_len, ext);
+}
+
+static void
+add_path (const char *path, const char *root) {
+    struct stat st;
+    if (stat (path, &st) < 0) {
+        fprintf (stderr, "%s: not found\n", path);
+        return;
+    }
+    if (S_ISDIR (st.st_mode)) {
+        DIR *dir = opendir (path);
+        struct dirent *de;
+        if (!dir) {
+            return;
+        }
+        while ((de = readdir (dir))) {
+            if (de->d_name[0] == '.') {
+                continue;
+            }
+            char child[PATH_MAX];
+            snprintf (child, sizeof (child), "%s/%s", path, de->d_name);
+            if (has_ext (de->d_name, ".qsf") || has_ext (de->d_name, ".miniqsf") || ( stat (child, &st) == 0 && S_ISDIR (st.st_mode) )) {
+                add_path (child, root);
+            }
+        }
+        closedir (dir);
+        return;
+    }
+    hq_plugin.insert (NULL, NULL, path);
+
+    int count = hqhost_playlist_count ();
+    item_roots = realloc (item_roots, (count ? count : 1) * sizeof (const char *));
+    while (item_root_count < count) {
+        item_roots[item_root_count++] = root;
+    }
+}
+
+// the argument itself for a directory, its parent for a file
+static char *
+arg_root (const char *arg) {
+    struct stat st;
+    char *root = strdup (arg);
+    size_t len = strlen (root);
+    while (len > 1 && root[len - 1] == '/') {
+        root[--len] = 0;
+    }
+    if (stat (arg, &st) == 0 && S_ISDIR (st.st_mode)) {
+        return root;
+    }
+    char *sep = strrchr (root, '/');
+    if (sep) {
+        sep[sep == root ? 1 : 0] = 0;
+    }
+    else {
+        root[0] = 0;
+    }
+    return root;
+}
+
+// create the directories leading up to a file
+static void
+make_parents (const char *path) {
+    char dir[PATH_MAX];
+    snprintf (dir, sizeof (dir), "%s", path);
+    char *p;
+    for (p = dir + 1; *p; p++) {
+        if (*p == '/') {
+            *p = 0;
+            mkdir (dir, 0755);
+            *p = '/';
+        }
+    }
+}
+
+// longest tracks first, so the last one to start is a short one
+static int
+track_cmp (const void *a, const void *b) {
+    float da = ((const render_track_t *)a)->duration;
+    float db = ((const render_track_t *)b)->duration;
+    return da < db ? 1 : da > db ? -1 : 0;
+}
+
+static void
+put_le (FILE *f, uint32_t value, int size) {
+    while (size--) {
+        fputc (value & 0xff, f);
+        value >>= 8;
+    }
+}
+
+static void
+write_wav_header (FILE *f, const ddb_waveformat_t *fmt, uint32_t data_size) {
+    int frame_size = fmt->channels * fmt->bps / 8;
+    fwrite ("RIFF", 1, 4, f);
+    put_le (f, 36 + data_size, 4);
+    fwrite ("WAVEfmt ", 1, 8, f);
+    put_le (f, 16, 4);
+    put_le (f, fmt->is_float ? 3 : 1, 2);
+    put_le (f, fmt->channels, 2);
+    put_le (f, fmt->samplerate, 4);
+    put_le (f, fmt->samplerate * frame_size, 4);
+    put_le (f, frame_size, 2);
+    put_le (f, fmt->bps, 2);
+    fwrite ("data", 1, 4, f);
+    put_le (f, data_size, 4);
+}
+
+// the track's path below its root goes under out_dir, so tracks of the same name in
+// different directories stay apart
+static int
+render_track (render_track_t *track) {
+    const char *uri = hqhost_item_meta (track->it, ":URI");
+    const char *rel = uri;
+    size_t root_len = strlen (track->root);
+    if (root_len && !strncmp (uri, track->root, root_len)) {
+        rel = uri + root_len;
+    }
+    while (*rel == '/') {
+        rel++;
+    }
+
+    char out_path[PATH_MAX];
+    const char *base = strrchr (rel, '/');
+    const char *ext = strrchr (base ? base : rel, '.');
+    int rel_len = ext ? (int)( ext - rel ) : (int)strlen (rel);
+    if (snprintf (out_path, sizeof (out_path), "%s/%.*s.wav", out_dir, rel_len, rel) >= (int)sizeof (out_path)) {
+        fprintf (stderr, "%s: output path too long\n", uri);
+        return -1;
+    }
+
+    DB_fileinfo_t *fi = hq_plugin.open (0);
+    if (hq_plugin.init (fi, track->it) < 0) {
+        fprintf (stderr, "%s: failed to open\n", uri);
+        hq_plugin.free (fi);
+        return -1;
+    }
+
+    // never replace an existing file, whether from an earlier run or another thread
+    make_parents (out_path);
+    int fd = open (out_path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    FILE *f = fd >= 0 ? fdopen (fd, "wb") : NULL;
+    if (!f) {
+        fprintf (stderr, "%s: %s\n", out_path, errno == EEXIST ? "already exists" : "can't write");
+        if (fd >= 0) {
+            close (fd);
+        }
+        hq_plugin.free (fi);
+        return -1;
+    }
+    write_wav_header (f, &fi->fmt, 0);
+
+    char buffer[16384];
+    uint32_t data_size = 0;
+    int rd;
+    while ((rd = hq_plugin.read (fi, buffer, sizeof (buffer))) > 0) {
+        fwrite (buffer, 1, rd, f);
+        data_size += rd;
+    }
+
+    fseek (f, 0, SEEK_SET);
+    write_wav_header (f, &fi->fmt, data_size);
+    int err = ferror (f);
+    if (fclose (f) || err) {
+        fprintf (stderr, "%s: write error\n", out_path);
+        hq_plugin.free (fi);
+        return -1;
+    }
+
+    track->duration = (float)data_size / ( fi->fmt.channels * fi->fmt.bps / 8 ) / fi->fmt.samplerate;
+    hq_plugin.free (fi);
+    return 0;
+}
+
+// workers take the next track from the sorted list until none are left
+static void *
+render_thread (void *ctx) {
+    (void) ctx;
+    for (;;) {
+        int idx = __atomic_fetch_add (&next_track, 1, __ATOMIC_RELAXED);
+        if (idx >= track_count) {
+            break;
+        }
+        render_track_t *track = &tracks[idx];
+        double t = hqhost_time ();
+        track->failed = render_track (track) < 0;
+        track->seconds = hqhost_time () - t;
+
+        if (!track->failed) {
+            pthread_mutex_lock (&print_mutex);
+            printf ("%8.2f s  %8.3f s  %7.2fx realtime  %s\n", track->duration, track->seconds,
+                    track->duration / track->seconds, hqhost_item_meta (track->it, ":URI"));
+            pthread_mutex_unlock (&print_mutex);
+        }
+    }
+    return NULL;
+}
+
+int
+main (int argc, char **argv) {
+    int threads = 0;
+    int opt;
+
+    while ((opt = getopt (argc, argv, "d:j:fs:o:")) != -1) {
+        switch (opt) {
+        case 'd':
+            out_dir = optarg;
+            break;
+        case 'j':
+            threads = atoi (optarg);
+            break;
+        case 'f':
+            hqhost_conf_set ("hq.output_float", "1");
+            break;
+        case 's':
+            hqhost_conf_set ("hq.samplerate", optarg);
+            break;
+        case 'o': {
+            char *eq = strchr (optarg, '=');
+            if (!eq) {
+                usage ();
+            }
+            *eq = 0;
+            hqhost_conf_set (optarg, eq + 1);
+            break;
+        }
+        default:
+            usage ();
+        }
+    }
+    if (optind >= argc) {
+        usage ();
+    }
+    if (threads <= 0) {
+        threads = sysconf (_SC_NPROCESSORS_ONLN);
+    }
+    if (threads <= 0) {
+        threads = 1;
+    }
+
+    hqhost_init ();
+
+    int i;
+    char **roots = malloc ((argc - optind) * sizeof (char *));
+    for (i = optind; i < argc; i++) {
+        roots[i - optind] = arg_root (argv[i]);
+        add_path (argv[i], roots[i - optind]);
+    }
+
+    track_count = hqhost_playlist_count ();
+    tracks = calloc (track_count ? track_count : 1, sizeof (render_track_t));
+    for (i = 0; i < track_count; i++) {
+        tracks[i].it = hqhost_playlist_get (i);
+        tracks[i].root = i < item_root_count ? item_roots[i] : "";
+        tracks[i].duration = hqhost_item_duration (tracks[i].it);
+    }
+    qsort (tracks, track_count, sizeof (render_track_t), track_cmp);
+
+    if (threads > track_count) {
+        threads = track_count;
+    }
+
+    double t = hqhost_time ();
+    pthread_t *tids = malloc ((threads ? threads : 1) * sizeof (pthread_t));
+    for (i = 0; i < threads; i++) {
+        pthread_create (&tids[i], NULL, render_thread, NULL);
+    }
+    for (i = 0; i < threads; i++) {
+        pthread_join (tids[i], NULL);
+    }
+    t = hqhost_time () - t;
+
+    double audio = 0, busy = 0;
+    int failed = 0;
+    for (i = 0; i < track_count; i++) {
+        if (tracks[i].failed) {
+            failed++;
+            continue;
+        }
+        audio += tracks[i].duration;
+        busy += tracks[i].seconds;
+    }
+    printf ("rendered %d of %d tracks, %.2f s of audio in %.3f s on %d threads: %.2fx realtime, %.2fx per thread\n",
+            track_count - failed, track_count, audio, t, threads, t > 0 ? audio / t : 0, busy > 0 ? audio / busy : 0);
+
+    free (tids);
+    free (tracks);
+    for (i = optind; i < argc; i++) {
+        free (roots[i - optind]);
+    }
+    free (roots);
+    free (item_roots);
+    hqhost_shutdown ();
+    return failed ? 1 : 0;
+}
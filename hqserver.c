@@ -0,0 +1,333 @@
+/*
+    Multi-stream decoding: many open tracks rendered in fixed-size blocks by
+    one worker thread per core, earliest deadline first.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+*/
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hqhost.h"
+#include "hqserver.h"
+
+// Each stream keeps a ring of queue_blocks rendered blocks. A stream with room in
+// its ring and no worker on it waits in the run queue, a heap ordered by when the
+// first frame of its next block is due; workers always take the top one. A full
+// ring leaves the queue until its reader frees a block, so a slow or stalled
+// reader costs nothing but its own memory. Streams of the same ROM set share the
+// plugin's ROM cache, so extra streams cost emulator state, not ROM images.
+
+struct hqstream_s {
+    hqserver_t *server;
+    DB_fileinfo_t *fi;
+    int block_bytes;
+    int samplerate;
+    int frame_size;
+    char *ring;
+    int *fill;                  // bytes in each block of the ring
+    long head;                  // blocks the reader finished
+    long tail;                  // blocks rendered
+    int head_pos;               // bytes of the head block already read
+    double start;
+    int queued;                 // index in the run queue, -1 if not in it
+    int busy;                   // a worker is rendering its next block
+    int done;                   // the decoder reached the end
+    int closing;
+    pthread_cond_t cond;
+};
+
+struct hqserver_s {
+    pthread_mutex_t mutex;
+    pthread_cond_t work;
+    hqstream_t **queue;
+    int queue_size;
+    int queue_alloc;
+    int block_frames;
+    int queue_blocks;
+    int stopping;
+    int threads;
+    pthread_t *tids;
+    hqserver_stats_t stats;
+};
+
+static double
+stream_due (const hqstream_t *s) {
+    return s->start + (double)s->tail * s->block_bytes / s->frame_size / s->samplerate;
+}
+
+static void
+queue_set (hqserver_t *server, int i, hqstream_t *s) {
+    server->queue[i] = s;
+    s->queued = i;
+}
+
+static void
+queue_up (hqserver_t *server, int i) {
+    hqstream_t *s = server->queue[i];
+    double due = stream_due (s);
+    while (i > 0) {
+        int parent = ( i - 1 ) / 2;
+        if (stream_due (server->queue[parent]) <= due) {
+            break;
+        }
+        queue_set (server, i, server->queue[parent]);
+        i = parent;
+    }
+    queue_set (server, i, s);
+}
+
+static void
+queue_down (hqserver_t *server, int i) {
+    hqstream_t *s = server->queue[i];
+    double due = stream_due (s);
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= server->queue_size) {
+            break;
+        }
+        if (child + 1 < server->queue_size && stream_due (server->queue[child + 1]) < stream_due (server->queue[child])) {
+            child++;
+        }
+        if (due <= stream_due (server->queue[child])) {
+            break;
+        }
+        queue_set (server, i, server->queue[child]);
+        i = child;
+    }
+    queue_set (server, i, s);
+}
+
+static void
+queue_push (hqserver_t *server, hqstream_t *s) {
+    if (server->queue_size == server->queue_alloc) {
+        server->queue_alloc = server->queue_alloc ? server->queue_alloc * 2 : 64;
+        server->queue = realloc (server->queue, server->queue_alloc * sizeof (hqstream_t *));
+    }
+    queue_set (server, server->queue_size++, s);
+    queue_up (server, s->queued);
+    pthread_cond_signal (&server->work);
+}
+
+static void
+queue_remove (hqserver_t *server, hqstream_t *s) {
+    int i = s->queued;
+    s->queued = -1;
+    if (--server->queue_size == i) {
+        return;
+    }
+    hqstream_t *last = server->queue[server->queue_size];
+    queue_set (server, i, last);
+    queue_up (server, i);
+    queue_down (server, last->queued);
+}
+
+// a stream goes back in the queue when it has room, nobody renders it and it has more to give
+static void
+stream_requeue (hqserver_t *server, hqstream_t *s) {
+    if (s->queued < 0 && !s->busy && !s->done && !s->closing && s->tail - s->head < server->queue_blocks) {
+        queue_push (server, s);
+    }
+}
+
+static void *
+worker_thread (void *ctx) {
+    hqserver_t *server = ctx;
+    pthread_mutex_lock (&server->mutex);
+    for (;;) {
+        if (server->stopping) {
+            break;
+        }
+        if (!server->queue_size) {
+            pthread_cond_wait (&server->work, &server->mutex);
+            continue;
+        }
+        hqstream_t *s = server->queue[0];
+        queue_remove (server, s);
+        s->busy = 1;
+        int slot = s->tail % server->queue_blocks;
+        double due = stream_due (s);
+        pthread_mutex_unlock (&server->mutex);
+
+        double t = hqhost_time ();
+        // reads may come back short mid-track, e.g. from the render-ahead ring; only a
+        // read that returns nothing is the end
+        char *block = s->ring + (size_t)slot * s->block_bytes;
+        int rd = 0, n;
+        while (rd < s->block_bytes && (n = hq_plugin.read (s->fi, block + rd, s->block_bytes - rd)) > 0) {
+            rd += n;
+        }
+        double now = hqhost_time ();
+
+        pthread_mutex_lock (&server->mutex);
+        s->busy = 0;
+        server->stats.busy += now - t;
+        if (rd > 0) {
+            s->fill[slot] = rd;
+            s->tail++;
+            server->stats.blocks++;
+            if (now > due) {
+                server->stats.missed++;
+                if (now - due > server->stats.worst_late) {
+                    server->stats.worst_late = now - due;
+                }
+            }
+        }
+        if (rd < s->block_bytes) {
+            s->done = 1;
+        }
+        stream_requeue (server, s);
+        pthread_cond_broadcast (&s->cond);
+    }
+    pthread_mutex_unlock (&server->mutex);
+    return NULL;
+}
+
+hqserver_t *
+hqserver_create (int threads, int block_frames, int queue_blocks) {
+    int cpus = sysconf (_SC_NPROCESSORS_ONLN);
+    if (cpus <= 0) {
+        cpus = 1;
+    }
+    if (threads <= 0) {
+        threads = cpus;
+    }
+    hqserver_t *server = calloc (1, sizeof (hqserver_t));
+    pthread_mutex_init (&server->mutex, NULL);
+    pthread_cond_init (&server->work, NULL);
+    server->block_frames = block_frames > 0 ? block_frames : 4096;
+    server->queue_blocks = queue_blocks > 1 ? queue_blocks : 2;
+    server->threads = threads;
+    server->tids = malloc (threads * sizeof (pthread_t));
+
+    int i;
+    for (i = 0; i < threads; i++) {
+        pthread_create (&server->tids[i], NULL, worker_thread, server);
+        // one worker per core; with more workers than cores they double up
+        cpu_set_t cpu;
+        CPU_ZERO (&cpu);
+        CPU_SET (i % cpus, &cpu);
+        pthread_setaffinity_np (server->tids[i], sizeof (cpu), &cpu);
+    }
+    return server;
+}
+
+void
+hqserver_destroy (hqserver_t *server) {
+    pthread_mutex_lock (&server->mutex);
+    server->stopping = 1;
+    pthread_cond_broadcast (&server->work);
+    pthread_mutex_unlock (&server->mutex);
+
+    int i;
+    for (i = 0; i < server->threads; i++) {
+        pthread_join (server->tids[i], NULL);
+    }
+    free (server->tids);
+    free (server->queue);
+    pthread_cond_destroy (&server->work);
+    pthread_mutex_destroy (&server->mutex);
+    free (server);
+}
+
+int
+hqserver_threads (hqserver_t *server) {
+    return server->threads;
+}
+
+void
+hqserver_stats (hqserver_t *server, hqserver_stats_t *stats) {
+    pthread_mutex_lock (&server->mutex);
+    *stats = server->stats;
+    pthread_mutex_unlock (&server->mutex);
+}
+
+hqstream_t *
+hqserver_open (hqserver_t *server, DB_playItem_t *it, double start) {
+    DB_fileinfo_t *fi = hq_plugin.open (0);
+    if (hq_plugin.init (fi, it) < 0) {
+        hq_plugin.free (fi);
+        return NULL;
+    }
+
+    hqstream_t *s = calloc (1, sizeof (hqstream_t));
+    s->server = server;
+    s->fi = fi;
+    s->samplerate = fi->fmt.samplerate;
+    s->frame_size = fi->fmt.channels * fi->fmt.bps / 8;
+    s->block_bytes = server->block_frames * s->frame_size;
+    s->ring = malloc ((size_t)server->queue_blocks * s->block_bytes);
+    s->fill = calloc (server->queue_blocks, sizeof (int));
+    s->start = start;
+    s->queued = -1;
+    pthread_cond_init (&s->cond, NULL);
+
+    pthread_mutex_lock (&server->mutex);
+    stream_requeue (server, s);
+    pthread_mutex_unlock (&server->mutex);
+    return s;
+}
+
+void
+hqserver_close (hqstream_t *s) {
+    hqserver_t *server = s->server;
+    pthread_mutex_lock (&server->mutex);
+    s->closing = 1;
+    if (s->queued >= 0) {
+        queue_remove (server, s);
+    }
+    while (s->busy) {
+        pthread_cond_wait (&s->cond, &server->mutex);
+    }
+    pthread_mutex_unlock (&server->mutex);
+
+    hq_plugin.free (s->fi);
+    pthread_cond_destroy (&s->cond);
+    free (s->fill);
+    free (s->ring);
+    free (s);
+}
+
+const ddb_waveformat_t *
+hqserver_format (hqstream_t *s) {
+    return &s->fi->fmt;
+}
+
+int
+hqserver_read (hqstream_t *s, char *bytes, int size, int wait) {
+    hqserver_t *server = s->server;
+    pthread_mutex_lock (&server->mutex);
+    while (s->head == s->tail) {
+        if (s->done || !wait) {
+            pthread_mutex_unlock (&server->mutex);
+            return s->done ? -1 : 0;
+        }
+        pthread_cond_wait (&s->cond, &server->mutex);
+    }
+
+    int total = 0;
+    while (size > 0 && s->head < s->tail) {
+        int slot = s->head % server->queue_blocks;
+        int n = s->fill[slot] - s->head_pos;
+        if (n > size) {
+            n = size;
+        }
+        memcpy (bytes + total, s->ring + (size_t)slot * s->block_bytes + s->head_pos, n);
+        total += n;
+        size -= n;
+        s->head_pos += n;
+        if (s->head_pos == s->fill[slot]) {
+            s->head++;
+            s->head_pos = 0;
+        }
+    }
+    stream_requeue (server, s);
+    pthread_mutex_unlock (&server->mutex);
+    return total;
+}
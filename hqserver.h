@@ -0,0 +1,44 @@
+/*
+    Multi-stream decoding: many open tracks rendered in fixed-size blocks by
+    one worker thread per core, earliest deadline first.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+*/
+
+#ifndef HQSERVER_H
+#define HQSERVER_H
+
+#include <deadbeef/deadbeef.h>
+
+typedef struct hqserver_s hqserver_t;
+typedef struct hqstream_s hqstream_t;
+
+typedef struct {
+    long blocks;                // rendered so far, over all streams
+    long missed;                // blocks finished after they were due
+    double worst_late;          // seconds, of the latest of those
+    double busy;                // seconds the workers spent rendering
+} hqserver_stats_t;
+
+// threads 0 means one per core; every stream renders block_frames at a time and
+// gets at most queue_blocks ahead of its reader before it waits
+hqserver_t * hqserver_create (int threads, int block_frames, int queue_blocks);
+// its streams must be closed first
+void hqserver_destroy (hqserver_t *server);
+int hqserver_threads (hqserver_t *server);
+void hqserver_stats (hqserver_t *server, hqserver_stats_t *stats);
+
+// opens the track on the calling thread, then hands it to the workers; its first
+// frame is due at start (hqhost_time clock), the rest at its sample rate from there
+hqstream_t * hqserver_open (hqserver_t *server, DB_playItem_t *it, double start);
+void hqserver_close (hqstream_t *stream);
+const ddb_waveformat_t * hqserver_format (hqstream_t *stream);
+
+// copies out up to size bytes of rendered audio: 0 when none is ready yet, -1 after
+// the end of the track; with wait it blocks until some is
+int hqserver_read (hqstream_t *stream, char *bytes, int size, int wait);
+
+#endif
@@ -0,0 +1,39 @@
+/*
+    Decode instrumentation for the QSF decoder. The counters only exist when
+    the plugin is built with HQ_STATS defined; without it hq_get_stats fails.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+*/
+
+#ifndef HQSTATS_H
+#define HQSTATS_H
+
+#include <stdint.h>
+#include <deadbeef/deadbeef.h>
+
+// bucket i counts reads that took under 2^(i+1) microseconds, the last one everything slower
+#define HQ_STATS_READ_BUCKETS 16
+
+typedef struct {
+    uint64_t load_ns;           // opening the track, ROM loading included
+    uint64_t reads;
+    uint64_t read_ns;
+    uint64_t read_max_ns;
+    uint64_t read_hist[HQ_STATS_READ_BUCKETS];
+    uint64_t frames_output;
+    uint64_t frames_silent;     // output frames that were silence, written without the output stage
+    uint64_t frames_rendered;   // by the emulator, whether heard or skipped
+    uint64_t frames_skipped;    // rendered without output to reach a seek target
+    uint64_t seeks;
+    uint64_t seek_ns;
+    uint64_t seek_resets;       // seeks that had to start over from the beginning
+    double realtime;            // seconds of output per second spent reading and seeking
+} hq_stats_t;
+
+// counters of an open track so far; -1 when the plugin was built without them
+int hq_get_stats (DB_fileinfo_t *fi, hq_stats_t *stats);
+
+#endif